@@ -0,0 +1,630 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of an index list */
+#define NIL -1
+
+/* Capacity of the read-ahead queue, in runs of blocks */
+#define PREFETCH_QUEUE 64
+
+/* Largest run of blocks read ahead in one transfer */
+#define PREFETCH_MAX_BLOCKS 64
+
+/* One cached block */
+struct cache_entry {
+	/* Index of the block on disk */
+	size_t block;
+	/* Content of the block (BLOCK_SIZE bytes) */
+	char *data;
+	/* Modified since it was read from or written to disk */
+	int dirty;
+	/* Neighbours in the LRU list, or next free entry */
+	int prev, next;
+	/* Next entry in the same hash bucket */
+	int hnext;
+};
+
+/* Run of adjacent blocks to read ahead */
+struct prefetch_run {
+	size_t block;
+	size_t count;
+};
+
+/* Read-ahead thread and its queue */
+struct prefetch {
+	pthread_t thread;
+	int started;
+	int stop;
+	struct prefetch_run queue[PREFETCH_QUEUE];
+	size_t head, len;
+	/* Blocks being read by the thread, and whether they were written since */
+	size_t busy_block, busy_count;
+	int busy_stale;
+	char *buf;
+	pthread_cond_t work, ready;
+};
+
+/* Block cache instance */
+struct cache {
+	/* Entries and their block buffers */
+	struct cache_entry *entries;
+	char *data;
+	size_t size;
+	/* Hash table of the cached entries, by block index */
+	int *buckets;
+	size_t mask;
+	/* Most and least recently used entries */
+	int head, tail;
+	/* Unused entries */
+	int free;
+	struct cache_stats stats;
+	struct prefetch prefetch;
+};
+
+/* Cache of the currently open virtual disk (disabled by default) */
+static struct cache cache;
+
+/* Protects the cache; never held across disk reads of uncached blocks */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t cache_hash(size_t block)
+{
+	return (block * 2654435761u) & cache.mask;
+}
+
+static int cache_lookup(size_t block)
+{
+	int i;
+
+	for (i = cache.buckets[cache_hash(block)]; i != NIL;
+	     i = cache.entries[i].hnext)
+		if (cache.entries[i].block == block)
+			return i;
+
+	return NIL;
+}
+
+static void cache_hash_remove(int idx)
+{
+	int *link = &cache.buckets[cache_hash(cache.entries[idx].block)];
+
+	while (*link != idx)
+		link = &cache.entries[*link].hnext;
+	*link = cache.entries[idx].hnext;
+}
+
+static void cache_lru_unlink(int idx)
+{
+	struct cache_entry *e = &cache.entries[idx];
+
+	if (e->prev != NIL)
+		cache.entries[e->prev].next = e->next;
+	else
+		cache.head = e->next;
+
+	if (e->next != NIL)
+		cache.entries[e->next].prev = e->prev;
+	else
+		cache.tail = e->prev;
+}
+
+static void cache_lru_push(int idx)
+{
+	struct cache_entry *e = &cache.entries[idx];
+
+	e->prev = NIL;
+	e->next = cache.head;
+	if (cache.head != NIL)
+		cache.entries[cache.head].prev = idx;
+	cache.head = idx;
+	if (cache.tail == NIL)
+		cache.tail = idx;
+}
+
+/* Mark entry @idx as the most recently used one */
+static void cache_touch(int idx)
+{
+	if (cache.head == idx)
+		return;
+
+	cache_lru_unlink(idx);
+	cache_lru_push(idx);
+}
+
+/*
+ * Blocks @block to @block + @count - 1 are being written: a read-ahead of any
+ * of them that is in progress would insert stale content
+ */
+static void cache_written(size_t block, size_t count)
+{
+	struct prefetch *pf = &cache.prefetch;
+
+	if (pf->busy_count && block < pf->busy_block + pf->busy_count &&
+	    pf->busy_block < block + count)
+		pf->busy_stale = 1;
+}
+
+/* Whether block @block is being read ahead */
+static int cache_prefetching(size_t block)
+{
+	struct prefetch *pf = &cache.prefetch;
+
+	return pf->busy_count && block >= pf->busy_block &&
+	       block < pf->busy_block + pf->busy_count;
+}
+
+/* Get an entry for a new block, evicting the least recently used one if needed */
+static int cache_get_slot(void)
+{
+	int idx;
+
+	if (cache.free != NIL) {
+		idx = cache.free;
+		cache.free = cache.entries[idx].next;
+		return idx;
+	}
+
+	idx = cache.tail;
+	if (cache.entries[idx].dirty) {
+		cache_written(cache.entries[idx].block, 1);
+		if (block_write(cache.entries[idx].block, cache.entries[idx].data))
+			return NIL;
+		cache.stats.writebacks++;
+	}
+
+	cache_hash_remove(idx);
+	cache_lru_unlink(idx);
+	cache.stats.evictions++;
+
+	return idx;
+}
+
+/* Make entry @idx hold block @block */
+static void cache_insert(int idx, size_t block, int dirty)
+{
+	struct cache_entry *e = &cache.entries[idx];
+	size_t bucket = cache_hash(block);
+
+	e->block = block;
+	e->dirty = dirty;
+	e->hnext = cache.buckets[bucket];
+	cache.buckets[bucket] = idx;
+	cache_lru_push(idx);
+}
+
+/* Read a run of blocks ahead in the cache, leaving cached blocks alone */
+static void cache_prefetch_run(size_t block, size_t count)
+{
+	struct prefetch *pf = &cache.prefetch;
+	size_t i, j, run;
+	int idx, ret;
+
+	for (i = 0; i < count; i += run) {
+		/* Skip over the cached blocks */
+		if (cache_lookup(block + i) != NIL) {
+			run = 1;
+			continue;
+		}
+
+		for (run = 1; i + run < count; run++)
+			if (cache_lookup(block + i + run) != NIL)
+				break;
+
+		pf->busy_block = block + i;
+		pf->busy_count = run;
+		pf->busy_stale = 0;
+		pthread_mutex_unlock(&cache_lock);
+
+		ret = block_read_range(block + i, run, pf->buf);
+
+		/* Waiters only get to look up the blocks once they are inserted */
+		pthread_mutex_lock(&cache_lock);
+		pf->busy_count = 0;
+		pthread_cond_broadcast(&pf->ready);
+		if (pf->stop || ret)
+			return;
+		if (pf->busy_stale)
+			continue;
+
+		for (j = 0; j < run; j++) {
+			if (cache_lookup(block + i + j) != NIL)
+				continue;
+			idx = cache_get_slot();
+			if (idx == NIL)
+				break;
+			memcpy(cache.entries[idx].data, &pf->buf[j * BLOCK_SIZE],
+			       BLOCK_SIZE);
+			cache_insert(idx, block + i + j, 0);
+			cache.stats.prefetched++;
+		}
+	}
+}
+
+static void *cache_prefetch_thread(void *arg)
+{
+	struct prefetch *pf = &cache.prefetch;
+	struct prefetch_run run;
+
+	(void)arg;
+
+	pthread_mutex_lock(&cache_lock);
+
+	while (1) {
+		while (!pf->stop && !pf->len)
+			pthread_cond_wait(&pf->work, &cache_lock);
+		if (pf->stop)
+			break;
+
+		run = pf->queue[pf->head];
+		pf->head = (pf->head + 1) % PREFETCH_QUEUE;
+		pf->len--;
+
+		cache_prefetch_run(run.block, run.count);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return NULL;
+}
+
+int cache_prefetch(size_t block, size_t count)
+{
+	struct prefetch *pf = &cache.prefetch;
+	size_t n;
+
+	if (!cache.size)
+		return -1;
+
+	pthread_mutex_lock(&cache_lock);
+
+	if (!pf->started) {
+		pf->buf = malloc(PREFETCH_MAX_BLOCKS * BLOCK_SIZE);
+		pthread_cond_init(&pf->work, NULL);
+		pthread_cond_init(&pf->ready, NULL);
+		pf->stop = 0;
+		if (!pf->buf || pthread_create(&pf->thread, NULL,
+					       cache_prefetch_thread, NULL)) {
+			cache_error("cannot start read-ahead thread");
+			free(pf->buf);
+			pf->buf = NULL;
+			pthread_mutex_unlock(&cache_lock);
+			return -1;
+		}
+		pf->started = 1;
+	}
+
+	/* Read-ahead is only a hint: drop what does not fit in the queue */
+	while (count > 0 && pf->len < PREFETCH_QUEUE) {
+		n = count < PREFETCH_MAX_BLOCKS ? count : PREFETCH_MAX_BLOCKS;
+		pf->queue[(pf->head + pf->len) % PREFETCH_QUEUE] =
+			(struct prefetch_run){ block, n };
+		pf->len++;
+		block += n;
+		count -= n;
+	}
+
+	pthread_cond_signal(&pf->work);
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+/* Stop the read-ahead thread, dropping the runs still queued */
+static void cache_prefetch_stop(void)
+{
+	struct prefetch *pf = &cache.prefetch;
+
+	if (!pf->started)
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	pf->stop = 1;
+	pthread_cond_signal(&pf->work);
+	pthread_mutex_unlock(&cache_lock);
+
+	pthread_join(pf->thread, NULL);
+	pthread_cond_destroy(&pf->work);
+	pthread_cond_destroy(&pf->ready);
+	free(pf->buf);
+}
+
+int cache_init(size_t nblocks)
+{
+	size_t i, nbuckets = 1;
+
+	cache_destroy();
+
+	if (nblocks == 0)
+		return 0;
+
+	/* Keep the hash table at most half full */
+	while (nbuckets < 2 * nblocks)
+		nbuckets <<= 1;
+
+	cache.entries = calloc(nblocks, sizeof(struct cache_entry));
+	cache.data = malloc(nblocks * BLOCK_SIZE);
+	cache.buckets = malloc(nbuckets * sizeof(int));
+	if (!cache.entries || !cache.data || !cache.buckets) {
+		cache_error("cannot allocate %zu blocks", nblocks);
+		cache_destroy();
+		return -1;
+	}
+
+	cache.size = nblocks;
+	cache.mask = nbuckets - 1;
+	for (i = 0; i < nbuckets; i++)
+		cache.buckets[i] = NIL;
+	for (i = 0; i < nblocks; i++) {
+		cache.entries[i].data = &cache.data[i * BLOCK_SIZE];
+		cache.entries[i].next = i + 1 < nblocks ? (int)i + 1 : NIL;
+	}
+	cache.free = 0;
+
+	return 0;
+}
+
+void cache_destroy(void)
+{
+	cache_prefetch_stop();
+
+	free(cache.entries);
+	free(cache.data);
+	free(cache.buckets);
+
+	memset(&cache, 0, sizeof(cache));
+	cache.head = cache.tail = cache.free = NIL;
+}
+
+int cache_read(size_t block, void *buf)
+{
+	int idx;
+
+	if (!cache.size)
+		return block_read(block, buf);
+
+	pthread_mutex_lock(&cache_lock);
+
+	/* A block being read ahead is about to be cached */
+	while (cache_prefetching(block))
+		pthread_cond_wait(&cache.prefetch.ready, &cache_lock);
+
+	idx = cache_lookup(block);
+	if (idx != NIL) {
+		cache.stats.hits++;
+		cache_touch(idx);
+		memcpy(buf, cache.entries[idx].data, BLOCK_SIZE);
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	cache.stats.misses++;
+	pthread_mutex_unlock(&cache_lock);
+
+	/* Let other threads use the cache while reading from disk */
+	if (block_read(block, buf))
+		return -1;
+
+	pthread_mutex_lock(&cache_lock);
+
+	/* Another thread may have cached the block in the meantime */
+	idx = cache_lookup(block);
+	if (idx != NIL) {
+		memcpy(buf, cache.entries[idx].data, BLOCK_SIZE);
+	} else {
+		idx = cache_get_slot();
+		if (idx != NIL) {
+			memcpy(cache.entries[idx].data, buf, BLOCK_SIZE);
+			cache_insert(idx, block, 0);
+		}
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+int cache_peek(size_t block, void *buf)
+{
+	int idx;
+
+	if (!cache.size)
+		return -1;
+
+	pthread_mutex_lock(&cache_lock);
+
+	idx = cache_lookup(block);
+	if (idx != NIL) {
+		cache.stats.hits++;
+		memcpy(buf, cache.entries[idx].data, BLOCK_SIZE);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return idx != NIL ? 0 : -1;
+}
+
+int cache_write(size_t block, const void *buf)
+{
+	int idx, ret = 0;
+
+	if (!cache.size)
+		return block_write(block, buf);
+
+	pthread_mutex_lock(&cache_lock);
+
+	cache_written(block, 1);
+
+	idx = cache_lookup(block);
+	if (idx != NIL) {
+		cache.stats.hits++;
+		cache_touch(idx);
+	} else {
+		cache.stats.misses++;
+
+		/* The whole block is overwritten, no need to read it first */
+		idx = cache_get_slot();
+		if (idx == NIL) {
+			ret = block_write(block, buf);
+			pthread_mutex_unlock(&cache_lock);
+			return ret;
+		}
+		cache_insert(idx, block, 0);
+	}
+
+	memcpy(cache.entries[idx].data, buf, BLOCK_SIZE);
+	cache.entries[idx].dirty = 1;
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+int cache_read_range(size_t block, size_t count, void *buf)
+{
+	char *p = buf;
+	size_t i, run;
+	int idx;
+
+	if (!cache.size)
+		return block_read_range(block, count, buf);
+
+	if (count <= CACHE_BYPASS_BLOCKS) {
+		for (i = 0; i < count; i++)
+			if (cache_read(block + i, &p[i * BLOCK_SIZE]))
+				return -1;
+		return 0;
+	}
+
+	/*
+	 * Large range: take the blocks that are cached (they may be dirty) from
+	 * the cache, and read the runs in between straight from disk
+	 */
+	for (i = 0; i < count; i += run) {
+		pthread_mutex_lock(&cache_lock);
+
+		idx = cache_lookup(block + i);
+		if (idx != NIL) {
+			cache.stats.hits++;
+			memcpy(&p[i * BLOCK_SIZE], cache.entries[idx].data,
+			       BLOCK_SIZE);
+			pthread_mutex_unlock(&cache_lock);
+			run = 1;
+			continue;
+		}
+
+		for (run = 1; i + run < count; run++)
+			if (cache_lookup(block + i + run) != NIL)
+				break;
+
+		cache.stats.misses += run;
+		pthread_mutex_unlock(&cache_lock);
+
+		if (block_read_range(block + i, run, &p[i * BLOCK_SIZE]))
+			return -1;
+	}
+
+	return 0;
+}
+
+int cache_write_range(size_t block, size_t count, const void *buf)
+{
+	const char *p = buf;
+	size_t i;
+	int idx;
+
+	if (!cache.size)
+		return block_write_range(block, count, buf);
+
+	if (count <= CACHE_BYPASS_BLOCKS) {
+		for (i = 0; i < count; i++)
+			if (cache_write(block + i, &p[i * BLOCK_SIZE]))
+				return -1;
+		return 0;
+	}
+
+	/*
+	 * Large range: write through. The cached copies are updated first, so
+	 * that a dirty one written back meanwhile cannot overwrite the new
+	 * content on disk; it stays dirty, and is written back again later
+	 */
+	pthread_mutex_lock(&cache_lock);
+
+	/* A read-ahead that started before the write would be stale */
+	cache_written(block, count);
+
+	for (i = 0; i < count; i++) {
+		idx = cache_lookup(block + i);
+		if (idx == NIL)
+			continue;
+		memcpy(cache.entries[idx].data, &p[i * BLOCK_SIZE], BLOCK_SIZE);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return block_write_range(block, count, buf);
+}
+
+static int cache_cmp_block(const void *a, const void *b)
+{
+	const struct block_iovec *x = a, *y = b;
+
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+int cache_flush(void)
+{
+	struct block_iovec *iov;
+	size_t count = 0;
+	int idx, ret;
+
+	if (!cache.size)
+		return 0;
+
+	iov = malloc(cache.size * sizeof(struct block_iovec));
+	if (!iov) {
+		cache_error("cannot allocate flush list");
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+
+	for (idx = cache.head; idx != NIL; idx = cache.entries[idx].next) {
+		if (!cache.entries[idx].dirty)
+			continue;
+		iov[count].block = cache.entries[idx].block;
+		iov[count].buf = cache.entries[idx].data;
+		count++;
+	}
+
+	/* In block order, adjacent dirty blocks are written in one transfer */
+	qsort(iov, count, sizeof(struct block_iovec), cache_cmp_block);
+	ret = block_writev(iov, count);
+
+	if (!ret) {
+		for (idx = cache.head; idx != NIL; idx = cache.entries[idx].next)
+			cache.entries[idx].dirty = 0;
+		cache.stats.writebacks += count;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	free(iov);
+
+	return ret;
+}
+
+void cache_get_stats(struct cache_stats *stats)
+{
+	pthread_mutex_lock(&cache_lock);
+	*stats = cache.stats;
+	pthread_mutex_unlock(&cache_lock);
+}
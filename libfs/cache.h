@@ -0,0 +1,135 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+/*
+ * All functions but cache_init() and cache_destroy() can be called from several
+ * threads at once. Callers must not read a block while it is being written.
+ */
+
+/**
+ * Transfers of more blocks than this go straight to disk instead of being
+ * loaded in the cache, so that large sequential I/O does not evict everything
+ */
+#define CACHE_BYPASS_BLOCKS 16
+
+/**
+ * struct cache_stats - Block cache counters
+ * @hits: Block accesses served from the cache
+ * @misses: Block accesses that had to go to disk
+ * @evictions: Blocks dropped from the cache to make room for another block
+ * @writebacks: Dirty blocks written back to disk
+ * @prefetched: Blocks loaded in the cache by read-ahead
+ */
+struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+	size_t prefetched;
+};
+
+/**
+ * cache_init - Set up the block cache
+ * @nblocks: Capacity of the cache in blocks
+ *
+ * Set up a write-back LRU cache of @nblocks blocks in front of the currently
+ * open virtual disk. With a capacity of 0, every access goes straight to disk.
+ *
+ * Return: -1 if the cache cannot be allocated. 0 otherwise.
+ */
+int cache_init(size_t nblocks);
+
+/**
+ * cache_destroy - Release the block cache
+ *
+ * Drop every cached block without writing it back (see cache_flush()) and
+ * reset the counters.
+ */
+void cache_destroy(void);
+
+/**
+ * cache_read - Read a block through the cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block cannot be read from disk. 0 otherwise.
+ */
+int cache_read(size_t block, void *buf);
+
+/**
+ * cache_peek - Read a block only if it is cached
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Unlike cache_read(), never go to disk and never load the block in the cache.
+ *
+ * Return: -1 if the block is not cached. 0 otherwise.
+ */
+int cache_peek(size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty in the cache; it reaches the disk when it is
+ * evicted or when the cache is flushed.
+ *
+ * Return: -1 if a dirty block could not be written back to make room. 0
+ * otherwise.
+ */
+int cache_write(size_t block, const void *buf);
+
+/**
+ * cache_read_range - Read contiguous blocks through the cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Return: -1 if the blocks cannot be read from disk. 0 otherwise.
+ */
+int cache_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * cache_write_range - Write contiguous blocks through the cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Ranges longer than %CACHE_BYPASS_BLOCKS are written to disk immediately, and
+ * the cached copies of their blocks are updated.
+ *
+ * Return: -1 if the blocks cannot be written. 0 otherwise.
+ */
+int cache_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * cache_prefetch - Read blocks ahead in the cache
+ * @block: Index of the first block to read ahead
+ * @count: Number of blocks to read ahead
+ *
+ * Queue the blocks to be loaded in the cache by a background thread, so that
+ * later reads of them are hits. Blocks that are already cached are left alone,
+ * and runs that do not fit in the queue are dropped.
+ *
+ * Return: -1 if the cache is disabled or read-ahead cannot be started. 0
+ * otherwise.
+ */
+int cache_prefetch(size_t block, size_t count);
+
+/**
+ * cache_flush - Write every dirty block back to disk
+ *
+ * Return: -1 if a block could not be written back. 0 otherwise.
+ */
+int cache_flush(void);
+
+/**
+ * cache_get_stats - Get the cache counters
+ * @stats: Filled with the counters accumulated since cache_init()
+ */
+void cache_get_stats(struct cache_stats *stats);
+
+#endif /* _CACHE_H */
@@ -1,10 +1,21 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/* <linux/fs.h>, pulled in by <linux/io_uring.h>, has its own BLOCK_SIZE */
+#undef BLOCK_SIZE
+
 #include "disk.h"
 
 #define block_error(fmt, ...) \
@@ -13,21 +24,584 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Maximum number of buffers per vectored call (Linux's MAX_IOVEC) */
+#define MAX_IOVEC 1024
+
+/* Depth of the asynchronous submission queue */
+#define AIO_DEPTH 64
+
+/* Number of worker threads when io_uring is not available */
+#define AIO_THREADS 8
+
+/* Largest transfer issued for a single asynchronous request at once */
+#define AIO_MAX_LEN (1 << 30)
+
+/* Mapped io_uring submission and completion rings */
+struct aio_ring {
+	int fd;
+	unsigned entries;
+	/* Submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings */
+	void *sq_map, *cq_map;
+	size_t sq_size, cq_size;
+	/* Entries filled in the submission queue but not taken by the kernel */
+	unsigned queued;
+};
+
+/* Asynchronous engine of the open disk */
+struct aio {
+	/* Set up on first use */
+	int ready;
+	/* Backend: io_uring if ring.fd is valid, worker threads otherwise */
+	struct aio_ring ring;
+	pthread_t threads[AIO_THREADS];
+	int nthreads;
+	int stop;
+	/* Requests waiting to be issued, and completed requests to reap */
+	struct block_aio *pending, *pending_tail;
+	struct block_aio *completed, *completed_tail;
+	size_t ncompleted;
+	/* Requests issued to the backend */
+	size_t inflight;
+	/* A thread is blocked in the kernel waiting for io_uring completions */
+	int waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+};
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Mapping of the whole disk image (NULL if not memory-mapped) */
+	char *map;
 };
 
 /* Currently open virtual disk (invalid by default) */
 static struct disk disk = { .fd = INVALID_FD };
 
-int block_disk_open(const char *diskname)
+/* Counters of the currently open virtual disk, updated atomically */
+static struct block_stats stats;
+
+/* Asynchronous engine of the currently open virtual disk */
+static struct aio aio = {
+	.ring = { .fd = INVALID_FD },
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Transfer exactly @len bytes at byte offset @off of the disk image, retrying
+ * on short transfers and interruptions. Positional I/O leaves the file offset
+ * untouched, so concurrent callers do not race on it.
+ */
+static int disk_pread(void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread(disk.fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk image");
+			return -1;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int disk_pwrite(const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(disk.fd, p, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pwrite");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("no progress writing disk image");
+			return -1;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Vectored counterpart of disk_pread()/disk_pwrite(): transfer the @cnt
+ * buffers of @iov (modified in place) from/to byte offset @off, retrying until
+ * everything has been transferred.
+ */
+static int disk_prwv(struct iovec *iov, int cnt, off_t off, int write)
+{
+	ssize_t ret;
+
+	while (cnt > 0) {
+		if (write)
+			ret = pwritev(disk.fd, iov, cnt, off);
+		else
+			ret = preadv(disk.fd, iov, cnt, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("%s", write ? "no progress writing disk image"
+				    : "unexpected end of disk image");
+			return -1;
+		}
+		off += ret;
+
+		/* Skip over the fully transferred buffers */
+		while (cnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Check that blocks @block to @block + @count - 1 exist on the open disk */
+static int disk_check_range(size_t block, size_t count)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Account a transfer of @count blocks */
+static void disk_account(size_t count, int write)
+{
+	if (write) {
+		__atomic_fetch_add(&stats.writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats.blocks_written, count, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&stats.reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats.blocks_read, count, __ATOMIC_RELAXED);
+	}
+}
+
+/* Copy a block list from/to the memory-mapped disk image */
+static void disk_mapv(const struct block_iovec *iov, size_t count, int write)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		char *block = disk.map + iov[i].block * BLOCK_SIZE;
+
+		if (write)
+			memcpy(block, iov[i].buf, BLOCK_SIZE);
+		else
+			memcpy(iov[i].buf, block, BLOCK_SIZE);
+	}
+}
+
+/*
+ * Transfer a block list, issuing one vectored call per run of consecutive
+ * elements that refer to adjacent blocks
+ */
+static int disk_blockv(const struct block_iovec *iov, size_t count, int write)
+{
+	struct iovec vec[MAX_IOVEC];
+	size_t i, run;
+
+	for (i = 0; i < count; i += run) {
+		for (run = 0; i + run < count && run < MAX_IOVEC; run++) {
+			if (iov[i + run].block != iov[i].block + run)
+				break;
+			vec[run].iov_base = iov[i + run].buf;
+			vec[run].iov_len = BLOCK_SIZE;
+		}
+
+		if (disk_check_range(iov[i].block, run))
+			return -1;
+
+		disk_account(run, write);
+
+		if (disk.map) {
+			disk_mapv(&iov[i], run, write);
+			continue;
+		}
+
+		if (disk_prwv(vec, run, (off_t)iov[i].block * BLOCK_SIZE, write))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Asynchronous engine. Requests are queued on aio.pending until the backend
+ * can take them: io_uring keeps at most AIO_DEPTH of them in flight, and the
+ * fallback worker threads pick them one at a time. Finished requests are
+ * queued on aio.completed until block_aio_wait() reaps them. All lists are
+ * protected by aio.lock.
+ */
+
+static void aio_push(struct block_aio **head, struct block_aio **tail,
+		     struct block_aio *req)
+{
+	req->next = NULL;
+	if (*tail)
+		(*tail)->next = req;
+	else
+		*head = req;
+	*tail = req;
+}
+
+static struct block_aio *aio_pop(struct block_aio **head,
+				 struct block_aio **tail)
+{
+	struct block_aio *req = *head;
+
+	if (req) {
+		*head = req->next;
+		if (!*head)
+			*tail = NULL;
+	}
+
+	return req;
+}
+
+static void aio_complete(struct block_aio *req, int result)
+{
+	req->result = result;
+	aio_push(&aio.completed, &aio.completed_tail, req);
+	aio.ncompleted++;
+	pthread_cond_broadcast(&aio.done);
+}
+
+static int aio_ring_enter(unsigned submit, unsigned wait)
+{
+	return syscall(__NR_io_uring_enter, aio.ring.fd, submit, wait,
+		       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void aio_ring_unmap(void)
+{
+	struct aio_ring *r = &aio.ring;
+
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+	if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_size);
+	if (r->sq_map && r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_size);
+	if (r->fd != INVALID_FD)
+		close(r->fd);
+
+	memset(r, 0, sizeof(*r));
+	r->fd = INVALID_FD;
+}
+
+/* Set up an io_uring instance; fails quietly if the kernel does not allow it */
+static int aio_ring_setup(void)
+{
+	struct aio_ring *r = &aio.ring;
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &p);
+	if (r->fd < 0) {
+		r->fd = INVALID_FD;
+		return -1;
+	}
+
+	/* IORING_OP_READ/WRITE appeared along with this feature */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS))
+		goto fail;
+
+	r->entries = p.sq_entries;
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map = r->sq_map;
+	else
+		r->cq_map = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+	if (r->cq_map == MAP_FAILED)
+		goto fail;
+
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_map;
+	cq = r->cq_map;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+fail:
+	aio_ring_unmap();
+	return -1;
+}
+
+/* Move pending requests to the submission queue and hand them to the kernel */
+static void aio_ring_issue(void)
+{
+	struct aio_ring *r = &aio.ring;
+	struct block_aio *req;
+	unsigned tail = *r->sq_tail;
+	size_t len;
+	int ret;
+
+	while (aio.inflight < r->entries &&
+	       (req = aio_pop(&aio.pending, &aio.pending_tail))) {
+		struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+
+		len = req->count * BLOCK_SIZE - req->done;
+		if (len > AIO_MAX_LEN)
+			len = AIO_MAX_LEN;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = disk.fd;
+		sqe->addr = (uintptr_t)((char *)req->buf + req->done);
+		sqe->len = len;
+		sqe->off = (off_t)req->block * BLOCK_SIZE + req->done;
+		sqe->user_data = (uintptr_t)req;
+
+		r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+		tail++;
+		r->queued++;
+		aio.inflight++;
+	}
+
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (r->queued) {
+		ret = aio_ring_enter(r->queued, 0);
+		if (ret < 0) {
+			/* Entries left in the queue go with the next call */
+			if (errno != EINTR)
+				break;
+			continue;
+		}
+		r->queued -= ret;
+	}
+}
+
+/* Reap the completion queue, resubmitting short and interrupted transfers */
+static void aio_ring_reap(void)
+{
+	struct aio_ring *r = &aio.ring;
+	unsigned head = *r->cq_head;
+	struct block_aio *req;
+	int res;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+		req = (struct block_aio *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		head++;
+		aio.inflight--;
+
+		if (res == -EINTR || res == -EAGAIN) {
+			aio_push(&aio.pending, &aio.pending_tail, req);
+			continue;
+		}
+		if (res < 0) {
+			block_error("%s: %s", req->write ? "write" : "read",
+				    strerror(-res));
+			aio_complete(req, -1);
+			continue;
+		}
+		if (res == 0) {
+			block_error("%s", req->write ?
+				    "no progress writing disk image" :
+				    "unexpected end of disk image");
+			aio_complete(req, -1);
+			continue;
+		}
+
+		req->done += res;
+		if (req->done < req->count * BLOCK_SIZE)
+			aio_push(&aio.pending, &aio.pending_tail, req);
+		else
+			aio_complete(req, 0);
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	if (aio.pending || r->queued)
+		aio_ring_issue();
+}
+
+/* Fallback backend: carry out pending requests with blocking calls */
+static void *aio_worker(void *arg)
+{
+	struct block_aio *req;
+	size_t len;
+	off_t off;
+	int ret;
+
+	(void)arg;
+
+	pthread_mutex_lock(&aio.lock);
+
+	while (1) {
+		while (!aio.stop && !aio.pending)
+			pthread_cond_wait(&aio.work, &aio.lock);
+		if (aio.stop)
+			break;
+
+		req = aio_pop(&aio.pending, &aio.pending_tail);
+		aio.inflight++;
+		pthread_mutex_unlock(&aio.lock);
+
+		len = req->count * BLOCK_SIZE;
+		off = (off_t)req->block * BLOCK_SIZE;
+		if (req->write)
+			ret = disk_pwrite(req->buf, len, off);
+		else
+			ret = disk_pread(req->buf, len, off);
+
+		pthread_mutex_lock(&aio.lock);
+		aio.inflight--;
+		aio_complete(req, ret);
+	}
+
+	pthread_mutex_unlock(&aio.lock);
+
+	return NULL;
+}
+
+/* Set up the asynchronous engine, with io_uring if possible. Called locked */
+static int aio_setup(void)
+{
+	if (aio.ready)
+		return 0;
+
+	aio.stop = 0;
+
+	if (!disk.map && aio_ring_setup()) {
+		for (aio.nthreads = 0; aio.nthreads < AIO_THREADS;
+		     aio.nthreads++)
+			if (pthread_create(&aio.threads[aio.nthreads], NULL,
+					   aio_worker, NULL))
+				break;
+
+		if (aio.nthreads == 0) {
+			block_error("cannot start worker threads");
+			return -1;
+		}
+	}
+
+	aio.ready = 1;
+
+	return 0;
+}
+
+/* Tear down the asynchronous engine; requests still queued are dropped */
+static void aio_teardown(void)
+{
+	int i;
+
+	pthread_mutex_lock(&aio.lock);
+
+	if (!aio.ready) {
+		pthread_mutex_unlock(&aio.lock);
+		return;
+	}
+
+	aio.stop = 1;
+	pthread_cond_broadcast(&aio.work);
+	pthread_mutex_unlock(&aio.lock);
+
+	for (i = 0; i < aio.nthreads; i++)
+		pthread_join(aio.threads[i], NULL);
+
+	aio.pending = aio.pending_tail = NULL;
+
+	if (aio.ring.fd != INVALID_FD) {
+		/* Let the kernel finish with the buffers before releasing it */
+		while (aio.inflight) {
+			if (aio_ring_enter(0, 1) < 0 && errno != EINTR)
+				break;
+			aio_ring_reap();
+		}
+		aio_ring_unmap();
+	}
+
+	aio.nthreads = 0;
+	aio.completed = aio.completed_tail = NULL;
+	aio.ncompleted = 0;
+	aio.inflight = 0;
+	aio.ready = 0;
+}
+
+static int disk_open(const char *diskname, int mapped)
 {
 	int fd;
 	struct stat st;
+	void *map = NULL;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
@@ -46,6 +620,7 @@ int block_disk_open(const char *diskname)
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
@@ -53,15 +628,81 @@ int block_disk_open(const char *diskname)
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
 		return -1;
 	}
 
+	if (mapped) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return -1;
+		}
+	}
+
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.map = map;
+	memset(&stats, 0, sizeof(stats));
+
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t bcount, int preallocate)
+{
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (disk.fd != INVALID_FD) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Blocks that are not written stay a hole in the file */
+	if (ftruncate(fd, (off_t)bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	if (preallocate) {
+		errno = posix_fallocate(fd, 0, (off_t)bcount * BLOCK_SIZE);
+		if (errno) {
+			perror("posix_fallocate");
+			close(fd);
+			return -1;
+		}
+	}
+
+	disk.fd = fd;
+	disk.bcount = bcount;
+	disk.map = NULL;
+	memset(&stats, 0, sizeof(stats));
 
 	return 0;
 }
 
+int block_disk_open(const char *diskname)
+{
+	return disk_open(diskname, 0);
+}
+
+int block_disk_open_mmap(const char *diskname)
+{
+	return disk_open(diskname, 1);
+}
+
 int block_disk_close(void)
 {
 	if (disk.fd == INVALID_FD) {
@@ -69,6 +710,13 @@ int block_disk_close(void)
 		return -1;
 	}
 
+	aio_teardown();
+
+	if (disk.map) {
+		munmap(disk.map, disk.bcount * BLOCK_SIZE);
+		disk.map = NULL;
+	}
+
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
@@ -86,6 +734,30 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+int block_disk_sync(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Writes to a mapping are only tracked by the mapping */
+	if (disk.map) {
+		if (msync(disk.map, disk.bcount * BLOCK_SIZE, MS_SYNC)) {
+			perror("msync");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (fdatasync(disk.fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
 int block_write(size_t block, const void *buf)
 {
 	if (disk.fd == INVALID_FD) {
@@ -99,19 +771,15 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
+	disk_account(1, 1);
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
+	if (disk.map) {
+		memcpy(disk.map + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+		return 0;
 	}
 
-	return 0;
+	/* Perform the actual write into the disk image */
+	return disk_pwrite(buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
 }
 
 int block_read(size_t block, void *buf)
@@ -127,18 +795,184 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	disk_account(1, 0);
+
+	if (disk.map) {
+		memcpy(buf, disk.map + block * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
 	}
 
 	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return disk_pread(buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	if (disk_check_range(block, count))
+		return -1;
+
+	disk_account(count, 1);
+
+	if (disk.map) {
+		memcpy(disk.map + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+		return 0;
+	}
+
+	return disk_pwrite(buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	if (disk_check_range(block, count))
+		return -1;
+
+	disk_account(count, 0);
+
+	if (disk.map) {
+		memcpy(buf, disk.map + block * BLOCK_SIZE, count * BLOCK_SIZE);
+		return 0;
+	}
+
+	return disk_pread(buf, count * BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+}
+
+int block_writev(const struct block_iovec *iov, size_t count)
+{
+	return disk_blockv(iov, count, 1);
+}
+
+int block_readv(const struct block_iovec *iov, size_t count)
+{
+	return disk_blockv(iov, count, 0);
+}
+
+void *block_map(size_t block)
+{
+	if (disk.fd == INVALID_FD || !disk.map || block >= disk.bcount)
+		return NULL;
+
+	return disk.map + block * BLOCK_SIZE;
+}
+
+void block_get_stats(struct block_stats *out)
+{
+	out->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+	out->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+	out->blocks_read = __atomic_load_n(&stats.blocks_read,
+					   __ATOMIC_RELAXED);
+	out->blocks_written = __atomic_load_n(&stats.blocks_written,
+					      __ATOMIC_RELAXED);
+}
+
+int block_aio_submit(struct block_aio **reqs, size_t count)
+{
+	size_t i;
+
+	pthread_mutex_lock(&aio.lock);
+
+	if (aio_setup()) {
+		pthread_mutex_unlock(&aio.lock);
 		return -1;
 	}
 
+	for (i = 0; i < count; i++) {
+		reqs[i]->done = 0;
+
+		if (disk_check_range(reqs[i]->block, reqs[i]->count)) {
+			aio_complete(reqs[i], -1);
+			continue;
+		}
+
+		disk_account(reqs[i]->count, reqs[i]->write);
+
+		/* Memory copies do not need to wait */
+		if (disk.map) {
+			char *block = disk.map + reqs[i]->block * BLOCK_SIZE;
+			size_t len = reqs[i]->count * BLOCK_SIZE;
+
+			if (reqs[i]->write)
+				memcpy(block, reqs[i]->buf, len);
+			else
+				memcpy(reqs[i]->buf, block, len);
+			aio_complete(reqs[i], 0);
+			continue;
+		}
+
+		aio_push(&aio.pending, &aio.pending_tail, reqs[i]);
+	}
+
+	if (aio.ring.fd != INVALID_FD)
+		aio_ring_issue();
+	else
+		pthread_cond_broadcast(&aio.work);
+
+	pthread_mutex_unlock(&aio.lock);
+
 	return 0;
 }
 
+int block_aio_wait(struct block_aio **done, size_t min, size_t max)
+{
+	size_t n = 0;
+	int ret, err;
+
+	if (min > max)
+		min = max;
+
+	pthread_mutex_lock(&aio.lock);
+
+	if (!aio.ready) {
+		pthread_mutex_unlock(&aio.lock);
+		return min ? -1 : 0;
+	}
+
+	while (n < max) {
+		/* The completions are left to the thread waiting in the kernel */
+		if (aio.ring.fd != INVALID_FD && !aio.waiting)
+			aio_ring_reap();
+
+		while (n < max && aio.completed) {
+			done[n++] = aio_pop(&aio.completed,
+					    &aio.completed_tail);
+			aio.ncompleted--;
+		}
+
+		if (n >= min)
+			break;
+
+		/* Nothing left that could complete */
+		if (!aio.pending && !aio.inflight) {
+			pthread_mutex_unlock(&aio.lock);
+			return n ? (int)n : -1;
+		}
+
+		if (aio.ring.fd == INVALID_FD || aio.waiting) {
+			pthread_cond_wait(&aio.done, &aio.lock);
+			continue;
+		}
+
+		/*
+		 * Wait for the kernel without blocking other submitters. Nobody
+		 * else reaps meanwhile, so the requests still in flight are
+		 * bound to post a completion that ends the wait
+		 */
+		aio.waiting = 1;
+		pthread_mutex_unlock(&aio.lock);
+		ret = aio_ring_enter(0, 1);
+		err = errno;
+		pthread_mutex_lock(&aio.lock);
+		aio.waiting = 0;
+		pthread_cond_broadcast(&aio.done);
+
+		if (ret < 0 && err != EINTR) {
+			pthread_mutex_unlock(&aio.lock);
+			errno = err;
+			perror("io_uring_enter");
+			return n ? (int)n : -1;
+		}
+	}
+
+	pthread_mutex_unlock(&aio.lock);
+
+	return n;
+}
@@ -19,6 +19,36 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_mmap - Open virtual disk file as a memory mapping
+ * @diskname: Name of the virtual disk file
+ *
+ * Same as block_disk_open(), but the whole virtual disk file is mapped in
+ * memory: block reads and writes become memory copies, and block_map() gives
+ * direct access to the blocks' content. Modifications reach the virtual disk
+ * file at the latest when it is closed.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_mmap(const char *diskname);
+
+/**
+ * block_disk_create - Create and open a virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the virtual disk
+ * @preallocate: If non-zero, allocate storage for every block
+ *
+ * Create virtual disk file @diskname of @bcount blocks, replacing any existing
+ * file, and open it like block_disk_open(). Blocks read as zeros until they are
+ * written; unless @preallocate is set, they take no storage until then, so the
+ * time taken does not depend on @bcount.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be
+ * created, or if a virtual disk file is already open. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount, int preallocate);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -34,6 +64,17 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_sync - Make the virtual disk's writes durable
+ *
+ * Wait until every block written so far, with any function of this API, has
+ * reached the storage device holding the virtual disk file.
+ *
+ * Return: -1 if there was no virtual disk file opened or if flushing it fails.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
@@ -60,5 +101,155 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write contiguous blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, using a single transfer.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read contiguous blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, using a single transfer.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * struct block_iovec - One element of a scatter/gather block list
+ * @block: Index of the block
+ * @buf: Buffer of %BLOCK_SIZE bytes for the block's content
+ */
+struct block_iovec {
+	size_t block;
+	void *buf;
+};
+
+/**
+ * block_writev - Gather-write a list of blocks to disk
+ * @iov: Array of blocks and their source buffers
+ * @count: Number of elements in @iov
+ *
+ * Write each buffer of @iov into its block. The blocks do not need to be
+ * contiguous: consecutive elements of @iov that refer to adjacent blocks are
+ * issued as a single vectored transfer.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if a
+ * writing operation fails. 0 otherwise.
+ */
+int block_writev(const struct block_iovec *iov, size_t count);
+
+/**
+ * block_readv - Scatter-read a list of blocks from disk
+ * @iov: Array of blocks and their destination buffers
+ * @count: Number of elements in @iov
+ *
+ * Read each block of @iov into its buffer. The blocks do not need to be
+ * contiguous: consecutive elements of @iov that refer to adjacent blocks are
+ * issued as a single vectored transfer.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if a
+ * reading operation fails. 0 otherwise.
+ */
+int block_readv(const struct block_iovec *iov, size_t count);
+
+/**
+ * block_map - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Return a pointer to the %BLOCK_SIZE bytes of block @block inside the mapping
+ * of a virtual disk opened with block_disk_open_mmap(). Blocks are contiguous
+ * in the mapping, and the pointer stays valid until block_disk_close().
+ *
+ * Return: NULL if there is no memory-mapped virtual disk open or if @block is
+ * out of bounds. Otherwise the address of the block's content.
+ */
+void *block_map(size_t block);
+
+/**
+ * struct block_stats - Virtual disk counters
+ * @reads: Read requests; a range of blocks counts once, and so does each run of
+ * adjacent blocks of a block list
+ * @writes: Write requests, counted like @reads
+ * @blocks_read: Blocks read
+ * @blocks_written: Blocks written
+ */
+struct block_stats {
+	size_t reads;
+	size_t writes;
+	size_t blocks_read;
+	size_t blocks_written;
+};
+
+/**
+ * block_get_stats - Get the virtual disk counters
+ * @stats: Filled with the counters accumulated since the virtual disk file was
+ * opened, by every function of this API
+ */
+void block_get_stats(struct block_stats *stats);
+
+/**
+ * struct block_aio - Asynchronous transfer of contiguous blocks
+ * @block: Index of the first block
+ * @count: Number of blocks to transfer
+ * @buf: Buffer of @count * %BLOCK_SIZE bytes for the blocks' content
+ * @write: Non-zero to write the blocks, zero to read them
+ * @result: Set on completion: -1 if the transfer failed, 0 otherwise
+ * @data: Free for the caller's use
+ * @next: Used internally while the request is in flight
+ * @done: Used internally while the request is in flight
+ */
+struct block_aio {
+	size_t block;
+	size_t count;
+	void *buf;
+	int write;
+	int result;
+	void *data;
+	struct block_aio *next;
+	size_t done;
+};
+
+/**
+ * block_aio_submit - Start asynchronous block transfers
+ * @reqs: Array of pointers to the requests
+ * @count: Number of elements in @reqs
+ *
+ * Queue the transfers of @reqs and return without waiting for them. Requests
+ * are carried out through io_uring when the kernel allows it, and by a pool of
+ * worker threads otherwise; on a memory-mapped virtual disk they complete
+ * immediately. The requests and their buffers must stay valid until they are
+ * returned by block_aio_wait(), which must happen before block_disk_close().
+ *
+ * Return: -1 if the asynchronous engine cannot be started. 0 otherwise (a
+ * request for blocks out of bounds completes with a @result of -1).
+ */
+int block_aio_submit(struct block_aio **reqs, size_t count);
+
+/**
+ * block_aio_wait - Wait for asynchronous block transfers
+ * @done: Array filled with pointers to the completed requests
+ * @min: Minimum number of completed requests to wait for
+ * @max: Maximum number of completed requests to return (size of @done)
+ *
+ * Return: -1 if fewer than @min requests are in flight and none completed.
+ * Otherwise the number of completed requests placed in @done.
+ */
+int block_aio_wait(struct block_aio **done, size_t min, size_t max);
+
 #endif /* _DISK_H */
 
@@ -1,9 +1,13 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
 
@@ -11,22 +15,82 @@
 #define FS_SIGNATURE "ECS150FS"
 #define BLOCK_SIZE 4096
 
+//Signature of version 2 of the format, with a 32-bit FAT and 64-bit file sizes
+#define FS2_SIGNATURE "ECS150F2"
+
 #define SIGNATURE_BYTES 8
 
 #define SUPERBLOCK_INDEX 0
-#define SUPERBLOCK_UNUSED_BYTES 4079
+#define SUPERBLOCK_UNUSED_BYTES 4067
+#define SUPERBLOCK2_UNUSED_BYTES 4044
+
+//Features of a version 2 disk, in its superblock
+#define FS2_FEATURE_EXTENTS 0x1
+
+//End of a chain in a version 1 (16-bit) and a version 2 (32-bit) FAT
+#define FAT16_EOC 0xFFFF
+#define FAT32_EOC 0xFFFFFFFF
+
+//End of a chain as returned by nextBlock() and firstBlock(), whatever the version
+#define FAT_EOC -1
 
-#define FAT_EOC 0xFFFF
 #define FIRST_FAT_BLOCK_INDEX 1
 
 #define ROOT_ENTRIES 128
 #define ROOT_FILENAME_SIZE 16
 #define ROOT_ENTRY_UNUSED_BYTES 10
+#define ROOT2_ENTRY_UNUSED_BYTES 4
+
+//Type of an entry, in the first byte of its padding (all zeroes for the files
+//of older disks)
+#define ENTRY_FILE 0
+#define ENTRY_DIRECTORY 1
+
+//Separates the names of a path
+#define PATH_SEPARATOR '/'
+
+//Number of file locks. Each root entry has its own, the files of
+//subdirectories share them
+#define FILE_LOCKS ROOT_ENTRIES
 
 #define SUCCESS 0
 #define FAILURE -1
 
-#define FILE_NUM 32
+//Descriptors in the first chunk of the file table. Chunk i holds FD_CHUNK << i
+//of them, so that FD_CHUNKS chunks cover any number of descriptors
+#define FD_CHUNK FS_OPEN_MAX_COUNT
+#define FD_CHUNKS 26
+
+//Largest size of the file table
+#define FD_MAX (FD_CHUNK * ((1 << FD_CHUNKS) - 1))
+
+//Number of data blocks collected from the FAT at a time when reading or writing
+#define BATCH_BLOCKS 256
+
+//Blocks of a file between two blocks remembered by a descriptor without a block
+//map, to seek backwards without walking the FAT chain from its start
+#define MAP_STRIDE 64
+
+//Signatures of a journal and of a commit in it
+#define JOURNAL_SIGNATURE "ECS150JL"
+#define COMMIT_SIGNATURE "ECS150JC"
+
+//Commits alternate between two slots of the journal, so that the last one is
+//intact while the next one is written
+#define JOURNAL_SLOTS 2
+
+//Largest number of blocks of subdirectories in a commit, fewer on small disks
+#define JOURNAL_DIR_BLOCKS 64
+
+//Blocks of subdirectories changed by a directory operation, at most: the
+//entry's block, a block added to the directory, and the directory's own entry
+#define DIR_OP_BLOCKS 3
+
+//Initial read-ahead window, in blocks
+#define READAHEAD_MIN_BLOCKS 4
+
+//Number of block transfers reaped at once by fs_aio_wait()
+#define AIO_REAP_BATCH 64
 
 //Superblock
 typedef struct Superblock
@@ -37,17 +101,87 @@ typedef struct Superblock
     int16_t datastartindex; //Data block start index
     int16_t numDataBlocks; //Amount of data blocks
     int8_t numFATBlocks; //Number of blocks for FAT (File Allocation Table)
+    int8_t journalSignature[SIGNATURE_BYTES]; //"ECS150JL" if the disk has a journal
+    int16_t journalStart; //First data block of the journal
+    int16_t journalBlocks; //Number of data blocks of the journal
     int8_t padding [SUPERBLOCK_UNUSED_BYTES]; //Unused/padding
     
 } __attribute__((packed)) Superblock;
 
-//One entry in root directory
+//Superblock of version 2, where every block number is 32 bits
+typedef struct Superblock2
+{
+    int8_t signature[SIGNATURE_BYTES]; //Signature (must be equal to "ECS150F2")
+    uint32_t numBlocks; //Total amount of blocks of virtual disk
+    uint32_t rootindex; //Root directory block index
+    uint32_t datastartindex; //Data block start index
+    uint32_t numDataBlocks; //Amount of data blocks
+    uint32_t numFATBlocks; //Number of blocks for FAT (File Allocation Table)
+    int8_t journalSignature[SIGNATURE_BYTES]; //"ECS150JL" if the disk has a journal
+    uint32_t journalStart; //First data block of the journal
+    uint32_t journalBlocks; //Number of data blocks of the journal
+    uint32_t features; //FS2_FEATURE_* flags, a disk with unknown ones is not mounted
+    uint32_t extentindex; //First block of the extent table (FS2_FEATURE_EXTENTS)
+    int8_t padding [SUPERBLOCK2_UNUSED_BYTES]; //Unused/padding
+
+} __attribute__((packed)) Superblock2;
+
+//Layout of a disk, decoded from either version of the superblock
+typedef struct Geometry
+{
+    int version; //1 for "ECS150FS", 2 for "ECS150F2"
+    int fatBits; //Size of a FAT entry in bits, 1 for the bitmap of a disk with extents
+    int numBlocks;
+    int rootindex;
+    int datastartindex;
+    int numDataBlocks;
+    int numFATBlocks;
+    int journal; //The disk has a journal
+    int journalStart;
+    int journalBlocks;
+    int extents; //Files are stored as extents, the FAT only tells which blocks are used
+    int extentindex; //First block of the extent table, one block per root entry
+
+} Geometry;
+
+//First block of a commit in the journal, followed by a copy of each metadata
+//block it changes
+typedef struct Commitheader
+{
+    int8_t signature[SIGNATURE_BYTES]; //Signature (must be equal to "ECS150JC")
+    uint64_t sequence; //Commits are numbered from 1 since the journal was emptied
+    uint64_t checksum; //Of the header and the copies, computed with this field at 0
+    uint32_t numBlocks; //Number of metadata blocks in the commit
+    uint32_t blocks[]; //Disk block of each copy
+
+} __attribute__((packed)) Commitheader;
+
+//Number of metadata blocks a commit header can list
+#define COMMIT_MAX_BLOCKS ((BLOCK_SIZE - sizeof(Commitheader)) / sizeof(uint32_t))
+
+//One entry in root directory. The rest of the entry depends on the version of
+//the disk, and is accessed through fileSize() and firstBlock()
 typedef struct Rootentry
 {
     int8_t filename[ROOT_FILENAME_SIZE]; //Filename (including NULL character)
-    int32_t filesize; //Size of the file (in bytes)
-    int16_t firstdatablockindex; //Index of first data block
-    int8_t padding [ROOT_ENTRY_UNUSED_BYTES]; //Unused/padding
+    union
+    {
+        struct
+        {
+            int32_t filesize; //Size of the file (in bytes)
+            int16_t firstdatablockindex; //Index of first data block
+            int8_t padding [ROOT_ENTRY_UNUSED_BYTES]; //Unused/padding
+
+        } __attribute__((packed)) v1;
+
+        struct
+        {
+            uint64_t filesize;
+            uint32_t firstdatablockindex;
+            int8_t padding [ROOT2_ENTRY_UNUSED_BYTES];
+
+        } __attribute__((packed)) v2;
+    };
     
 } __attribute__((packed)) Rootentry;
 
@@ -57,844 +191,4706 @@ typedef struct Rootdirecotry
     Rootentry entries [ROOT_ENTRIES];
 } __attribute__((packed)) Rootdirectory;
 
-typedef uint16_t* FAT;
+//16-bit or 32-bit entries, depending on the version of the disk, or one bit
+//per block on a disk with extents
+typedef void* FAT;
 
-//file info 
-typedef struct Fileinfo
+//Run of length data blocks starting at data block start, holding the blocks of
+//a file from block logical on
+typedef struct Extent
 {
-    int8_t open; //Tells if file has been closed
-    int32_t block_offset; //offset on the block (bytes), 0 on open
-    int32_t total_offset; //total offset
-    int16_t block; //current block
-    int16_t first_block; //first block
-    Rootentry* root;
-
-} __attribute__((packed)) Fileinfo;
+    uint32_t logical;
+    uint32_t start;
+    uint32_t length;
 
-typedef struct disk
-{
-    char *diskname;
-    Superblock *superblock;
-    FAT fat;
-    Rootdirectory *root;
-    
-} disk;
+} __attribute__((packed)) Extent;
 
-disk *mounteddisk = NULL;
+#define EXTENTS_PER_FILE ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(Extent))
 
-struct Fileinfo openfiles[FILE_NUM]; 
+//A file that cannot grow in place gets a new extent of at least 1/EXTENT_GROWTH
+//of its blocks, so that files written at the same time do not take an extent
+//per block
+#define EXTENT_GROWTH 8
 
-//Use FAT to get the next data block in the chain
-static int nextBlock(int currentBlock)
+//Extents of a file on a disk with extents, in the block of the extent table
+//matching its root entry. The extents are sorted and cover the file's blocks
+//without gaps
+typedef struct Extentlist
 {
-    return mounteddisk->fat[currentBlock];
-}
+    uint32_t numExtents;
+    uint32_t padding;
+    Extent extents[EXTENTS_PER_FILE];
+    int8_t unused[(BLOCK_SIZE - 2 * sizeof(uint32_t)) % sizeof(Extent)]; //Fills the block
 
-//return the first availible fat entry
-static int findFreeFAT()
-{
-    for(int i = 0; i < BLOCK_SIZE/2 * mounteddisk->superblock->numFATBlocks; i++)
-    {
-        if(mounteddisk->fat[i] == 0)
-        {
-            return i;
-        }
-    }
+} __attribute__((packed)) Extentlist;
 
-    printf("No free FAT\n");
+//Marks an empty slot of a directory index
+#define NO_ENTRY -1
 
-    return FAILURE;
-}
+//No file descriptor
+#define NO_FD -1
 
-//sets up a new fat entry
-static int allocNewFATEntry(int currentBlock)
+//Directory index: open-addressing hash table from filename to entry number,
+//plus a bitmap of the free entries and the number of files
+typedef struct Dirindex
 {
-    int block = findFreeFAT();
+    int *slots; //Entry number stored in each slot, NO_ENTRY if empty
+    int mask; //Number of slots - 1 (a power of two)
+    uint64_t *freeEntries; //One bit per entry, set if the entry is free
+    int numEntries; //Number of entries in the directory
+    int numFiles; //Number of entries in use
+    int freeHint; //Words of freeEntries before this one have no free entry
 
-    if(block == FAILURE)
-         return FAILURE;
+} Dirindex;
 
-    mounteddisk->fat[currentBlock] = block;
-    mounteddisk->fat[block] = FAT_EOC;
-    
-    return block;
-}
+//Entries of a block of a subdirectory
+#define DIR_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(Rootentry))
+
+struct Directory;
 
-//Find data block at fd's offset
-static int getDataBlock(int fd)
+//State of an open file, shared by its descriptors
+typedef struct Openfile
 {
-    //Get the starting data block
-    int currBlock = openfiles[fd].first_block;
+    struct Directory *dir; //Directory of the file's entry
+    int entry; //Number of the entry in its directory
+    int refs; //Number of descriptors of the file
 
-    //Get the offset
-    int offset = openfiles[fd].total_offset;
+} Openfile;
 
-    //Go to next block until offset is less than block size
-    while(offset > BLOCK_SIZE)
-    {
-        currBlock = nextBlock(currBlock);
-        offset -= BLOCK_SIZE;
-    }
+//Bookkeeping of a block of a subdirectory in memory, in place of its first
+//entry, which is never used: the block holding an entry is found from the
+//entry's address, as blocks are aligned
+typedef struct Dirheader
+{
+    struct Directory *dir; //Directory the block belongs to
+    union Dirblock *nextDead; //Next block of a deleted directory, to be freed
+    int32_t index; //Number of the block in its directory
+    uint32_t block; //Data block holding it
+    uint32_t version; //Number of changes, tells if it changed while committed
+    uint8_t dirty; //The block is in the list of modified blocks
+    uint8_t dead; //Its directory was deleted
 
-    //Set the block offset
-    openfiles[fd].block_offset = offset;
+} Dirheader;
 
-    return currBlock;
-}
+//The header must fit in the entry it overlays
+_Static_assert(sizeof(Dirheader) <= sizeof(Rootentry), "Dirheader does not fit in an entry");
 
-//Calculate the number of blocks that must be written
-static int numBlocksToWrite(int fd, size_t count)
+//Block of a subdirectory, which is stored like a file of entries
+typedef union Dirblock
 {
-    //If count is 0, no blocks need to be written
-    if(count == 0)
-        return 0;
+    Dirheader header;
+    Rootentry entries[DIR_BLOCK_ENTRIES];
 
-    //Otherwise, at least 1 block must be written
-    int numBlocks = 1;
+} Dirblock;
 
-    signed int numBytes = (signed int) count;
-
-    //Subtract the written that must be read from the first block
-    numBytes -= (BLOCK_SIZE - openfiles[fd].block_offset);
+//A directory in memory: the root directory, or a subdirectory whose blocks are
+//all loaded on mount
+typedef struct Directory
+{
+    Rootentry *entry; //Entry of the directory in its parent, NULL for the root directory
+    Dirblock **blocks; //Blocks of a subdirectory
+    int numBlocks;
+    struct Directory **subdirs; //Directory of each entry that holds one, else NULL
+    Openfile **open; //State of each entry's file while it is open, else NULL
+    Dirindex index;
+    struct Directory *prev, *next; //List of every directory, from the root directory
 
-    //Every 4096 bytes means another block needs to be written
-    while(numBytes > 0)
-    {
-        numBlocks++;
-        numBytes -= BLOCK_SIZE;
-    }
+} Directory;
 
-    return numBlocks;
-}
+//file info 
+typedef struct Fileinfo
+{
+    int8_t open; //Tells if file has been closed
+    int32_t nextFree; //Next free descriptor, while this one is free
+    Openfile *node; //State shared with the file's other descriptors
+    int32_t block_offset; //offset on the block (bytes), 0 on open
+    size_t total_offset; //total offset
+    int32_t block; //current block
+    int32_t block_index; //index of the current block in the file, -1 if unknown
+    int32_t first_block; //first block
+    Rootentry* root;
+    uint32_t *map; //data block of each map_stride-th block of the file, NULL if not kept
+    int32_t map_stride; //1 for a block map, else MAP_STRIDE
+    int32_t map_length; //number of blocks in map
+    int32_t map_capacity; //number of blocks map can hold
+    uint8_t *bounce; //buffer for partial block transfers, NULL until needed
+    size_t ra_next; //offset where a sequential read would continue
+    int32_t ra_window; //current read-ahead window in blocks, 0 if not sequential
+    int32_t ra_end; //block of the file following the last one read ahead
+    //Buffered appends, protected by the file's lock: content of the file's last
+    //block (wbuf_len bytes), which is data block wbuf_block
+    uint8_t *wbuf;
+    size_t wbuf_len;
+    int32_t wbuf_block;
+    pthread_mutex_t lock; //Protects the descriptor (offset, cursor, map, buffer)
+
+} Fileinfo;
+
+//Write-ahead journal of the metadata
+typedef struct Journal
+{
+    int start; //Disk block of the first slot
+    int slotBlocks; //Blocks per slot: a header, then room for every metadata block
+    uint64_t sequence; //Number of the next commit
+    uint8_t *slot; //Commit being written
+    int dirRoom; //Blocks of subdirectories a commit can hold, after the metadata
+    Dirblock **dirBlocks; //Blocks of subdirectories in the commit being written
+    uint32_t *dirVersions; //Their versions when copied
+    int numDirBlocks;
+    uint64_t started; //Number of commits started by syncJournal()
+    uint64_t finished; //Number of commits finished
+    int running; //A commit is being written
+    int result; //Result of the last finished commit
+    int interval; //Milliseconds between background commits, 0 for none
+    int stop; //Tells the commit thread to exit
+    pthread_t thread;
+    pthread_mutex_t lock; //Protects the commit counters and the stop flag
+    pthread_cond_t done; //Signaled when a commit finishes
+    pthread_cond_t wake; //Signaled to stop the commit thread
+
+} Journal;
 
-//Calculate the number of blocks that must be read
-static int numBlocksToRead(int fd, size_t count)
+typedef struct disk
 {
-    //If count is 0, no blocks need to be read
-    if(count == 0)
-        return 0;
+    char *diskname;
+    void *superblock; //Superblock of either version, decoded in geo
+    Geometry geo;
+    FAT fat;
+    Rootdirectory *root;
+    Extentlist *extents; //Extent table, one list per root entry (NULL without extents)
+    int mapped; //Metadata points straight into the mapped disk image
+    uint8_t *fatDirty; //One flag per FAT block, set if it was modified (NULL if mapped)
+    int rootDirty; //The root directory was modified
+    uint8_t *extentsDirty; //One flag per block of the extent table, like fatDirty
+    Journal *journal; //NULL if metadata changes are written in place directly
+    uint64_t *freemap; //One bit per data block, set if the block is free
+    int freeBlocks; //Number of free data blocks
+    int allocHint; //Where the next search for a free block starts
+    Directory rootdir; //Root directory, first of the list of directories
+    Directory *lastDir; //Last directory of the list
+    Dirblock **dirtyBlocks; //Modified blocks of subdirectories
+    int numDirty;
+    int dirtyRoom; //Blocks dirtyBlocks can hold, at least numDirBlocks
+    int numDirBlocks; //Blocks of subdirectories in memory, deleted ones included
+    int reservedBlocks; //Blocks of subdirectories about to be modified (with a journal)
+    Dirblock *deadBlocks; //Blocks of deleted subdirectories
+    int blockMaps; //Keep a block map for every open file
+    int readahead; //Largest read-ahead window in blocks, 0 to disable read-ahead
+    int appendFd[FILE_LOCKS]; //fd holding buffered appends to a file of each lock, or NO_FD
+    pthread_rwlock_t dirLock; //Protects the directories and their indexes
+    pthread_mutex_t fatLock; //Protects the block allocator (free blocks, FAT entries of free blocks)
+    pthread_rwlock_t fileLocks[FILE_LOCKS]; //Protects the size and chain of the files of each lock
+    pthread_mutex_t dirtyLock; //Protects the list of modified blocks of subdirectories
+    
+} disk;
 
-    //Otherwise, at least 1 block must be read
-    int numBlocks = 1;
+//State of an asynchronous request while it is in flight
+typedef struct Aiostate
+{
+    struct fs_aio *req;
+    int pending; //Block transfers not completed yet
+    int failed; //A block transfer failed
+    uint8_t *bounce; //Partial first and last blocks of a read
+    size_t headOffset; //Offset of the read in its first block
+    size_t headLen; //Bytes read from the first block if it is partial, else 0
+    size_t tailPos; //Position in the read of the last block if it is partial
+    size_t tailLen; //Bytes read from the last block if it is partial, else 0
+    struct block_aio *transfers; //Block transfers of the read
+    struct block_aio **transferList; //Pointers to them, for block_aio_submit()
+    struct Aiostate *next; //Next completed request
+
+} Aiostate;
 
-    signed int numBytes = (signed int) count;
+disk *mounteddisk = NULL;
 
-    //Subtract the bytes that must be read from the first block
-    numBytes -= (BLOCK_SIZE - openfiles[fd].block_offset);
+//File table, grown a chunk at a time: descriptors never move, so they can be
+//looked up without fdTableLock
+static Fileinfo *openfiles[FD_CHUNKS];
+static int numFds = 0; //Descriptors in the table, updated atomically
+static int maxFds = FS_OPEN_MAX_COUNT; //Largest size of the table
+static int freeFds = NO_FD; //First free descriptor, NO_FD if none
+static int numOpen = 0; //Number of open descriptors
 
-    //Every 4096 bytes means another block needs to be read
-    while(numBytes > 0)
-    {
-        numBlocks++;
-        numBytes -= BLOCK_SIZE;
-    }
+//Protects the file table (open flags, free descriptors, shared file states)
+static pthread_mutex_t fdTableLock = PTHREAD_MUTEX_INITIALIZER;
 
-    return numBlocks;
-}
+//Completed asynchronous requests, and the number still waiting for blocks
+static Aiostate *aioReady = NULL;
+static Aiostate *aioReadyTail = NULL;
+static int aioWaiting = 0;
 
-//Check if char ptr is string (null-terminated)
-static int isString(const char *ptr)
-{
-    while(*ptr)
-        ptr++;
+//Protects the above and the requests' states; aioWaitLock serializes waiters
+static pthread_mutex_t aioLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t aioWaitLock = PTHREAD_MUTEX_INITIALIZER;
 
-    if(*ptr != '\0')
-        return FAILURE;
+//Activity counters, updated atomically. The disk counters are kept by disk.c
+static struct fs_stats stats;
 
-    else
-        return SUCCESS;
+//Locking order: dirLock, fdTableLock, a descriptor's lock, a file's lock,
+//fatLock, dirtyLock. The block cache has its own internal lock.
 
+//Get the number of the lock of the file stored in an entry. The entries of the
+//root directory follow each other, so each gets a lock of its own
+static int fileStripe(const Rootentry *file)
+{
+    return ((uintptr_t) file / sizeof(Rootentry)) % FILE_LOCKS;
 }
 
-//Check if root directory entry is free
-static int rootEntryFree(Rootentry entry)
+static pthread_rwlock_t *fileLock(Rootentry *file)
 {
-    if(entry.filename[0] != '\0')
-        return FAILURE;
+    return &mounteddisk->fileLocks[fileStripe(file)];
+}
 
-    return SUCCESS;
+//Get the fd holding buffered appends to a file, or to another file sharing its
+//lock: they are flushed by the same calls
+static int *appendFd(Rootentry *file)
+{
+    return &mounteddisk->appendFd[fileStripe(file)];
 }
 
-//Get the number of empty entries in root directory
-static int numEmptyEntriesRootDir()
+//Get file descriptor fd, which must be in the file table
+static Fileinfo *fdInfo(int fd)
 {
-    int numFreeEntries = 0;
+    int chunk = 31 - __builtin_clz(fd / FD_CHUNK + 1);
 
-    //An empty entry is defined by the first character of the entry's filename being the NULL character
-    for(int i = 0; i < ROOT_ENTRIES; i++)
-    {
-        if(rootEntryFree(mounteddisk->root->entries[i]) == SUCCESS)
-            numFreeEntries++;
-    }    
+    return &openfiles[chunk][fd - FD_CHUNK * ((1 << chunk) - 1)];
+}
 
-    return numFreeEntries;
+//Set the entry of a block in a FAT of entries of bits bits. A bitmap (1 bit)
+//only records if the block is used
+static void storeFAT(void *fat, int bits, int block, int next)
+{
+    if(bits == 32)
+        ((uint32_t *) fat)[block] = next == FAT_EOC ? FAT32_EOC : (uint32_t) next;
+    else if(bits == 16)
+        ((uint16_t *) fat)[block] = next == FAT_EOC ? FAT16_EOC : (uint16_t) next;
+    else if(next != 0)
+        ((uint8_t *) fat)[block / 8] |= 1 << (block % 8);
+    else
+        ((uint8_t *) fat)[block / 8] &= ~(1 << (block % 8));
 }
 
-//Get the number of files in the root directory
-static int numFilesRootDir()
+//Get a block of the FAT of the mounted disk
+static uint8_t *fatBlock(int index)
 {
-    int numfiles = 0;
+    return (uint8_t *) mounteddisk->fat + (size_t) index * BLOCK_SIZE;
+}
 
-    for(int i = 0; i < ROOT_ENTRIES; i++)
-    {
-        if(rootEntryFree(mounteddisk->root->entries[i]) != SUCCESS)
-            numfiles++;
-    }
+//Set the FAT entry of a block, remembering its FAT block has to be written
+static void setFAT(int block, int next)
+{
+    storeFAT(mounteddisk->fat, mounteddisk->geo.fatBits, block, next);
 
-    return numfiles;
+    if(mounteddisk->fatDirty != NULL)
+        mounteddisk->fatDirty[block / (BLOCK_SIZE * 8 / mounteddisk->geo.fatBits)] = 1;
 }
 
-//return a pointer to the first availible empty root entry
-static Rootentry* findNextEmpty()
+//Get the size of a file
+static size_t fileSize(const Rootentry *file)
 {
-    for(int i = 0; i < ROOT_ENTRIES; i++)
-    {
-        if(rootEntryFree(mounteddisk->root->entries[i]) == SUCCESS){
-	    return &mounteddisk->root->entries[i];
-	}
-    }
+    if(mounteddisk->geo.version == 2)
+        return file->v2.filesize;
 
-    return NULL;
+    return file->v1.filesize;
 }
 
-//Search for file in root directory
-static Rootentry* findFile(const char *filename)
+static void setFileSize(Rootentry *file, size_t size)
 {
-    for(int i = 0; i < ROOT_ENTRIES; i++)
-    {
-        char *currfile = (char *) mounteddisk->root->entries[i].filename;
+    if(mounteddisk->geo.version == 2)
+        file->v2.filesize = size;
+    else
+        file->v1.filesize = size;
+}
 
-        if(strcmp(currfile, filename) == 0)
-            return &mounteddisk->root->entries[i];
-    }
+//Get the first data block of a file, FAT_EOC if it is empty
+static int firstBlock(const Rootentry *file)
+{
+    if(mounteddisk->geo.version == 2)
+        return file->v2.firstdatablockindex == FAT32_EOC ? FAT_EOC : (int) file->v2.firstdatablockindex;
 
-    return NULL;
+    return (uint16_t) file->v1.firstdatablockindex == FAT16_EOC ? FAT_EOC : (uint16_t) file->v1.firstdatablockindex;
 }
 
-//Search for file in root directory
-static int fileFound(const char *filename)
+static void setFirstBlock(Rootentry *file, int block)
 {
-    for(int i = 0; i < ROOT_ENTRIES; i++)
-    {
-        char *currfile = (char *) mounteddisk->root->entries[i].filename;
+    if(mounteddisk->geo.version == 2)
+        file->v2.firstdatablockindex = block == FAT_EOC ? FAT32_EOC : (uint32_t) block;
+    else
+        file->v1.firstdatablockindex = block == FAT_EOC ? FAT16_EOC : (uint16_t) block;
+}
 
-        if(strcmp(currfile, filename) == 0)
-            return SUCCESS;
-    }
+//Remember the root directory has to be written. Writers of different files
+//can get here at the same time
+static void markRootDirty()
+{
+    __atomic_store_n(&mounteddisk->rootDirty, 1, __ATOMIC_RELAXED);
+}
 
-    return FAILURE;
+//Check if an entry is in the root directory rather than in a subdirectory
+static int inRootDirectory(const Rootentry *file)
+{
+    return file >= mounteddisk->root->entries && file < mounteddisk->root->entries + ROOT_ENTRIES;
 }
 
-//Check if file name is valid
-static int validFilename(const char *filename)
+//Get the block of a subdirectory holding an entry
+static Dirblock *entryBlock(const Rootentry *file)
 {
+    return (Dirblock *) ((uintptr_t) file & ~(uintptr_t) (BLOCK_SIZE - 1));
+}
 
-    //Check for invalid filename errors
+//Remember the block holding an entry has to be written. Subdirectories keep a
+//list of their modified blocks, as they can have any number of them
+static void markEntryDirty(const Rootentry *file)
+{
+    if(inRootDirectory(file))
+    {
+        markRootDirty();
+        return;
+    }
 
-    //Case 1: Filename not null-terminated
-    if(isString(filename) != SUCCESS)
-        return FAILURE;
+    Dirheader *header = &entryBlock(file)->header;
 
-    //Case 2: Filename length exceeds maximum
-    if(strlen(filename) > FS_FILENAME_LEN)
-        return FAILURE;
-    
-    
+    pthread_mutex_lock(&mounteddisk->dirtyLock);
 
-    return SUCCESS;
-}
+    header->version++;
 
-//Check if file table has space
-static int fileTableSpaceAvailable()
-{
-    for(int i = 0; i < FILE_NUM; i++)
+    //There is room for every block in the list
+    if(!header->dirty)
     {
-        if(openfiles[i].open == 0)
-            return SUCCESS;
+        header->dirty = 1;
+        mounteddisk->dirtyBlocks[mounteddisk->numDirty++] = entryBlock(file);
     }
 
-    return FAILURE;
+    pthread_mutex_unlock(&mounteddisk->dirtyLock);
 }
 
-//Check if fd is open
-static int isOpen(int fd)
+//Get the type of an entry
+static int entryType(const Rootentry *file)
 {
-    if(openfiles[fd].open != 1)
-        return FAILURE;
+    if(mounteddisk->geo.version == 2)
+        return file->v2.padding[0];
 
-    return SUCCESS;
+    return file->v1.padding[0];
 }
 
-//Check if file descriptor is within bounds
-static int fd_in_bounds(int fd)
+static void setEntryType(Rootentry *file, int type)
 {
-    if(fd > FILE_NUM)
-        return FAILURE;
+    if(mounteddisk->geo.version == 2)
+        file->v2.padding[0] = type;
+    else
+        file->v1.padding[0] = type;
+}
 
-    if(fd < 0)
-        return FAILURE;
+//Get the extents of a file, on a disk with extents
+static Extentlist *fileExtents(const Rootentry *file)
+{
+    return &mounteddisk->extents[file - mounteddisk->root->entries];
+}
 
-    return SUCCESS;
+//Remember the extents of a file have to be written. Like the root directory,
+//it is written under the file's lock only
+static void markExtentsDirty(const Rootentry *file)
+{
+    if(mounteddisk->extentsDirty != NULL)
+        __atomic_store_n(&mounteddisk->extentsDirty[file - mounteddisk->root->entries], 1, __ATOMIC_RELAXED);
 }
 
-//Check to make sure file descriptor is valid
-static int valid_fd(int fd)
+//Get the number of blocks held by a list of extents
+static int extentBlocks(const Extentlist *list)
 {
-    //Case 1: fd not in bounds
-    if(fd_in_bounds(fd) != SUCCESS)
-        return FAILURE;
+    if(list->numExtents == 0)
+        return 0;
 
-    //Case 2: fd not open
-    if(isOpen(fd) != SUCCESS)
-        return FAILURE;
+    const Extent *last = &list->extents[list->numExtents - 1];
 
-    return SUCCESS;
+    return last->logical + last->length;
 }
 
-//Check for read errors
-static int write_err_check(int fd)
+//Add to an activity counter
+static void addStat(size_t *counter, size_t n)
 {
-    //Case 1: invalid fd
-    if(valid_fd(fd) != SUCCESS)
-        return FAILURE;
-
-    return SUCCESS;
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
 }
 
-//Check for read errors
-static int read_err_check(int fd)
+//Current time in nanoseconds, to measure latencies
+static uint64_t clockNs()
 {
-    //Case 1: invalid fd
-    if(valid_fd(fd) != SUCCESS)
-        return FAILURE;
+    struct timespec now;
 
-    return SUCCESS;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-//Check for stat errors
-static int stat_err_check(int fd)
+//Count a call started at start in a latency histogram
+static void addLatency(size_t *histogram, uint64_t start)
 {
-    //Case 1: invalid fd
-    if(valid_fd(fd) != SUCCESS)
-        return FAILURE;
+    uint64_t elapsed = clockNs() - start;
+    int bucket = elapsed == 0 ? 0 : 63 - __builtin_clzll(elapsed);
 
-    return SUCCESS;
+    if(bucket >= FS_LATENCY_BUCKETS)
+        bucket = FS_LATENCY_BUCKETS - 1;
+
+    addStat(&histogram[bucket], 1);
 }
 
-//Check for seek errors
-static int lseek_err_check(int fd, size_t offset)
+//Use FAT to get the next data block in the chain (never on a disk with
+//extents). Walkers count their steps in the stats once they are done
+static int nextBlock(int currentBlock)
 {
-    //Case 1: invalid fd
-    if(valid_fd(fd) != SUCCESS)
-        return FAILURE;
-
-    //Case 2: offset out of bounds
+    //Chains are walked one step at a time, so the entry is read right here
+    if(mounteddisk->geo.fatBits == 16)
+    {
+        uint16_t next = ((uint16_t *) mounteddisk->fat)[currentBlock];
+        return next == FAT16_EOC ? FAT_EOC : next;
+    }
 
-    return SUCCESS;
+    uint32_t next = ((uint32_t *) mounteddisk->fat)[currentBlock];
+    return next == FAT32_EOC ? FAT_EOC : (int) next;
 }
 
-//Check for file closing errors
-static int close_err_check(int fd)
+//Number of 64-bit words in the free-block bitmap
+static int freeMapWords()
 {
-    //Case 1: invalid fd
-    if(valid_fd(fd) != SUCCESS)
-        return FAILURE;
-
-    return SUCCESS;
+    return (mounteddisk->geo.numDataBlocks + 63) / 64;
 }
 
-//Check for file opening errors
-static int open_err_check(const char *filename)
+//Build the free-block bitmap from the FAT
+static int buildFreeMap()
 {
-    //Case 1: Invalid filename
-    if(validFilename(filename) != SUCCESS)
-        return FAILURE;
+    int numBlocks = mounteddisk->geo.numDataBlocks;
 
-    //Case 2: Filename not found
-    if(fileFound(filename) != SUCCESS)
-        return FAILURE;
+    mounteddisk->freemap = calloc(freeMapWords(), sizeof(uint64_t));
 
-    //Case 3: File table full
-    if(fileTableSpaceAvailable() != SUCCESS)
+    if(mounteddisk->freemap == NULL)
         return FAILURE;
 
-    return SUCCESS;
-}
+    mounteddisk->freeBlocks = 0;
+    mounteddisk->allocHint = 0;
 
-//Check for file creation errors
-static int delete_err_check(const char *filename)
-{
-    //Case 1: Invalid filename
-    if(validFilename(filename) != SUCCESS)
-        return FAILURE;
+    const uint8_t *bitmap = mounteddisk->fat;
+    const uint16_t *fat16 = mounteddisk->fat;
+    const uint32_t *fat32 = mounteddisk->fat;
+    int bits = mounteddisk->geo.fatBits;
 
-    //Case 2: File does not exist
-    if(fileFound(filename) != SUCCESS)
-        return FAILURE;
+    //A FAT entry (or bit) of 0 corresponds to a free data block
+    for(int i = 0; i < numBlocks; i++)
+    {
+        int used = bits == 16 ? fat16[i] != 0 : bits == 32 ? fat32[i] != 0 : (bitmap[i / 8] >> (i % 8)) & 1;
+
+        if(!used)
+        {
+            mounteddisk->freemap[i / 64] |= 1ULL << (i % 64);
+            mounteddisk->freeBlocks++;
+        }
+    }
 
-    //Error check passed
     return SUCCESS;
 }
 
-//Check for file creation errors
-static int create_err_check(const char *filename)
+//return the first availible fat entry at or after block (FAILURE if none)
+static int findFreeFAT(int block)
 {
-    //Case 1: Invalid filename
-    if(validFilename(filename) != SUCCESS)
-        return FAILURE;
+    int numBlocks = mounteddisk->geo.numDataBlocks;
+    int first = block / 64;
+    int found = FAILURE;
+    int word;
 
-    //Case 2: No space in root directory
-    if(numFilesRootDir() == FS_FILE_MAX_COUNT)
-        return FAILURE;
+    for(word = first; block < numBlocks; word++, block = word * 64)
+    {
+        //Ignore the blocks before block in its word
+        uint64_t bits = mounteddisk->freemap[word] & (~0ULL << (block % 64));
 
-    //Case 3: File already exists
-    if(fileFound(filename) == SUCCESS)
-        return FAILURE;
+        if(bits != 0)
+        {
+            found = word * 64 + __builtin_ctzll(bits);
+            break;
+        }
+    }
 
-    //Error check passed
-    return SUCCESS;
+    addStat(&stats.alloc_scanned, word - first + (found != FAILURE));
+
+    return found;
 }
 
-//Write the FAT back out to disk
-static void writeFAT()
+//Get the length of the run of free blocks starting at block, up to max
+static int freeRunLength(int block, int max)
 {
-    for(int i = FIRST_FAT_BLOCK_INDEX; i < mounteddisk->superblock->numFATBlocks + FIRST_FAT_BLOCK_INDEX; i++)
+    int numBlocks = mounteddisk->geo.numDataBlocks;
+    int length = 0;
+    int scanned = 0;
+
+    while(length < max && block + length < numBlocks)
     {
-        block_write(i, &mounteddisk->fat[(i-1) * (BLOCK_SIZE/2)]);
-    }
-}
+        int curr = block + length;
+        uint64_t bits = mounteddisk->freemap[curr / 64] >> (curr % 64);
 
-//Write blocks back out to disk
-static void writeBlocks()
-{
-    //Write the superblock
-    block_write(SUPERBLOCK_INDEX, mounteddisk->superblock);
+        //Count the consecutive free blocks from curr within its word
+        int ones = ~bits == 0 ? 64 : __builtin_ctzll(~bits);
 
-    //Write the FAT
-    writeFAT();
+        scanned++;
 
-    //Write the root directory
-    block_write(mounteddisk->superblock->rootindex, mounteddisk->root);
-}
+        if(ones == 0)
+            break;
 
-//Copy the FAT of the mounted disk
-static void copyFAT()
-{
-    for(int i = FIRST_FAT_BLOCK_INDEX; i < mounteddisk->superblock->numFATBlocks + FIRST_FAT_BLOCK_INDEX; i++){
-        block_read(i, &mounteddisk->fat[(i-1) * (BLOCK_SIZE/2)]);
+        length += ones;
     }
 
+    addStat(&stats.alloc_scanned, scanned);
+
+    if(length > max)
+        length = max;
+
+    if(block + length > numBlocks)
+        length = numBlocks - block;
+
+    return length;
 }
 
-//Make sure the disk's signature is valid
-static int validSignature()
+//Reserve a run of up to want contiguous free blocks and chain them together.
+//The blocks directly following block after (FAILURE for none) are taken if
+//they are free, unless a larger run exists elsewhere: the first run that is
+//large enough starting from the allocation hint, or else the largest run
+//available. Returns the start of the run and stores its length in length
+static int allocRun(int want, int after, int *length)
 {
-    char signature[SIGNATURE_BYTES + 1];
+    int numBlocks = mounteddisk->geo.numDataBlocks;
+    int hint = mounteddisk->allocHint;
+    int start = FAILURE;
+    int len = 0;
 
-    //Turn the signature into a string
-    for(int i = 0; i < SIGNATURE_BYTES; i++)
-    {
-        signature[i] = mounteddisk->superblock->signature[i];
-    }
+    addStat(&stats.allocations, 1);
 
-    signature[SIGNATURE_BYTES] = '\0';
+    if(mounteddisk->freeBlocks == 0)
+        return FAILURE;
+
+    //Extend the chain in place when the following blocks are free
+    if(after != FAILURE && after + 1 < numBlocks)
+    {
+        len = freeRunLength(after + 1, want);
+
+        if(len > 0)
+            start = after + 1;
+    }
+
+    //Otherwise scan the free runs once around the disk, from the hint
+    int block = hint;
+    int wrapped = 0;
+
+    while(start == FAILURE || (len < want && block != FAILURE))
+    {
+        block = findFreeFAT(block);
+
+        if(block == FAILURE && !wrapped)
+        {
+            wrapped = 1;
+            block = findFreeFAT(0);
+        }
+
+        if(block == FAILURE || (wrapped && block >= hint))
+            break;
+
+        int runLength = freeRunLength(block, want);
+
+        if(runLength > len)
+        {
+            start = block;
+            len = runLength;
+        }
+
+        block += runLength;
+    }
+
+    if(start == FAILURE)
+        return FAILURE;
+
+    //Mark the run as used and link its blocks
+    for(int i = start; i < start + len; i++)
+    {
+        mounteddisk->freemap[i / 64] &= ~(1ULL << (i % 64));
+        setFAT(i, i + 1);
+    }
+
+    setFAT(start + len - 1, FAT_EOC);
+    mounteddisk->freeBlocks -= len;
+
+    //Next-fit: the next search starts right after this run
+    mounteddisk->allocHint = (start + len) % numBlocks;
+
+    *length = len;
+
+    return start;
+}
+
+//Release a data block
+static void freeBlock(int block)
+{
+    setFAT(block, 0);
+    mounteddisk->freemap[block / 64] |= 1ULL << (block % 64);
+    mounteddisk->freeBlocks++;
+}
+
+//Append numBlocks new blocks to the chain ending at block last (FAILURE to
+//start a new chain), using as few contiguous runs as possible. Returns the
+//first new block, and stores the number of blocks allocated in allocated
+static int extendChain(int last, int numBlocks, int *allocated)
+{
+    int first = FAILURE;
+
+    *allocated = 0;
+
+    while(*allocated < numBlocks)
+    {
+        int length;
+        int start = allocRun(numBlocks - *allocated, last, &length);
+
+        if(start == FAILURE)
+        {
+            printf("No free FAT\n");
+            break;
+        }
+
+        if(first == FAILURE)
+            first = start;
+
+        if(last != FAILURE)
+            setFAT(last, start);
+
+        last = start + length - 1;
+        *allocated += length;
+    }
+
+    return first;
+}
+
+//Record the data block of the next block of info's file in its block map
+static void mapAppend(Fileinfo *info, uint32_t block)
+{
+    if(info->map_length == info->map_capacity)
+    {
+        uint32_t *map = realloc(info->map, 2 * info->map_capacity * sizeof(uint32_t));
+
+        //Without memory, just stop keeping a map for this fd
+        if(map == NULL)
+        {
+            free(info->map);
+            info->map = NULL;
+            return;
+        }
+
+        info->map = map;
+        info->map_capacity *= 2;
+    }
+
+    info->map[info->map_length++] = block;
+}
+
+//Find the extent holding block of the file, which must have it: extents are
+//sorted, so this is a binary search
+static int findExtent(const Extentlist *list, int block)
+{
+    int low = 0;
+    int high = list->numExtents - 1;
+
+    while(low < high)
+    {
+        int mid = (low + high + 1) / 2;
+
+        if(list->extents[mid].logical <= (uint32_t) block)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
+//Append at least numBlocks new blocks to the extents of a file, merging runs
+//that directly follow its last extent into it. Returns the number of blocks
+//allocated, which is more when a new extent is preallocated for the file to
+//grow into, and fewer if the disk is full or the list has no room for another
+//extent. Called with fatLock and the file's lock held
+static int growExtents(Rootentry *file, int numBlocks)
+{
+    Extentlist *list = fileExtents(file);
+    int allocated = 0;
+
+    while(allocated < numBlocks)
+    {
+        Extent *last = list->numExtents > 0 ? &list->extents[list->numExtents - 1] : NULL;
+        int after = last != NULL ? (int) (last->start + last->length - 1) : FAILURE;
+        int want = numBlocks - allocated;
+        int length;
+
+        //A full list can only grow its last extent in place
+        if(list->numExtents == EXTENTS_PER_FILE)
+        {
+            want = freeRunLength(after + 1, want);
+
+            if(want == 0)
+                break;
+        }
+
+        //Leave room to grow in a new extent
+        else if(last != NULL && freeRunLength(after + 1, want) < want
+                && want < extentBlocks(list) / EXTENT_GROWTH)
+            want = extentBlocks(list) / EXTENT_GROWTH;
+
+        int start = allocRun(want, after, &length);
+
+        if(start == FAILURE)
+            break;
+
+        if(last != NULL && start == after + 1)
+            last->length += length;
+
+        else
+        {
+            Extent *extent = &list->extents[list->numExtents];
+
+            extent->logical = extentBlocks(list);
+            extent->start = start;
+            extent->length = length;
+            list->numExtents++;
+        }
+
+        allocated += length;
+    }
+
+    if(allocated == 0)
+        return 0;
+
+    markExtentsDirty(file);
+
+    //The root entry still tells where the file starts
+    if(firstBlock(file) == FAT_EOC)
+    {
+        setFirstBlock(file, list->extents[0].start);
+        markEntryDirty(file);
+    }
+
+    return allocated;
+}
+
+//Collect the data blocks of a file on a disk with extents, like
+//collectBlocks(): the extent holding the first block is found by a binary
+//search, and the others follow it
+static int collectExtents(Rootentry *file, int first, int numBlocks, int alloc, uint32_t *blocks)
+{
+    Extentlist *list = fileExtents(file);
+    int fileBlocks = extentBlocks(list);
+
+    if(alloc && first + numBlocks > fileBlocks)
+    {
+        pthread_mutex_lock(&mounteddisk->fatLock);
+        fileBlocks += growExtents(file, first + numBlocks - fileBlocks);
+        pthread_mutex_unlock(&mounteddisk->fatLock);
+    }
+
+    if(first >= fileBlocks)
+        return 0;
+
+    if(numBlocks > fileBlocks - first)
+        numBlocks = fileBlocks - first;
+
+    int collected = 0;
+
+    for(int i = findExtent(list, first); collected < numBlocks; i++)
+    {
+        const Extent *extent = &list->extents[i];
+        uint32_t block = extent->start + (first + collected - extent->logical);
+        uint32_t end = extent->start + extent->length;
+
+        while(block < end && collected < numBlocks)
+            blocks[collected++] = block++;
+    }
+
+    return collected;
+}
+
+//Collect the data blocks backing numBlocks consecutive blocks of info's file,
+//starting at logical block first. If alloc is set, the FAT chain is extended
+//as needed. Returns the number of blocks collected, which is smaller than
+//numBlocks if the chain ends (or the disk is full when allocating)
+static int collectBlocks(Fileinfo *info, int first, int numBlocks, int alloc, uint32_t *blocks)
+{
+    Rootentry *file = info->root;
+
+    //Files of a disk with extents have no chain to walk
+    if(mounteddisk->geo.extents)
+        return collectExtents(file, first, numBlocks, alloc, blocks);
+
+    int currBlock = firstBlock(file);
+    int collected = 0;
+    int allocated;
+    int start = 0;
+
+    //An empty file gets its first data blocks on the first write
+    if(currBlock == FAT_EOC)
+    {
+        if(!alloc)
+            return 0;
+
+        pthread_mutex_lock(&mounteddisk->fatLock);
+        currBlock = extendChain(FAILURE, first + numBlocks, &allocated);
+        pthread_mutex_unlock(&mounteddisk->fatLock);
+
+        if(currBlock == FAILURE)
+            return 0;
+
+        setFirstBlock(file, currBlock);
+        markEntryDirty(file);
+
+        //The disk is full, do not try again at the end of the new blocks
+        if(allocated < first + numBlocks)
+            alloc = 0;
+    }
+
+    //Take the blocks already known from the fd's block map, and continue
+    //walking the chain from the last block it knows
+    if(info->map != NULL && info->map_stride == 1 && info->map_length > 0)
+    {
+        while(collected < numBlocks && first + collected < info->map_length)
+        {
+            blocks[collected] = info->map[first + collected];
+            collected++;
+        }
+
+        if(collected == numBlocks)
+            return collected;
+
+        start = info->map_length - 1;
+        currBlock = info->map[start];
+    }
+
+    //A sparse map only tells where to start walking: from the last block it
+    //knows before the first block still wanted
+    if(info->map != NULL && info->map_stride > 1 && info->map_length > 0)
+    {
+        int entry = (first + collected) / info->map_stride;
+
+        if(entry >= info->map_length)
+            entry = info->map_length - 1;
+
+        start = entry * info->map_stride;
+        currBlock = info->map[entry];
+    }
+
+    //Resume from the fd's cursor instead if it is closer to the first block
+    //still wanted
+    if(info->block_index > start && info->block_index <= first + collected)
+    {
+        start = info->block_index;
+        currBlock = info->block;
+    }
+
+    int steps = 0;
+
+    for(int i = start; i < first + numBlocks; i++)
+    {
+        //Follow the chain, extending it with all the missing blocks at once
+        if(i > start)
+        {
+            int next = nextBlock(currBlock);
+
+            if(next == FAT_EOC)
+            {
+                if(!alloc)
+                    break;
+
+                pthread_mutex_lock(&mounteddisk->fatLock);
+                next = extendChain(currBlock, first + numBlocks - i, &allocated);
+                pthread_mutex_unlock(&mounteddisk->fatLock);
+
+                if(allocated == 0)
+                    break;
+
+                //The disk is full, do not try again at the end of the new blocks
+                if(allocated < first + numBlocks - i)
+                    alloc = 0;
+            }
+
+            currBlock = next;
+            steps++;
+        }
+
+        //Remember the blocks walked for the first time
+        if(info->map != NULL && i == info->map_length * info->map_stride)
+            mapAppend(info, currBlock);
+
+        if(i == first + collected)
+            blocks[collected++] = currBlock;
+    }
+
+    addStat(&stats.chain_steps, steps);
+
+    //Move the cursor to the last block collected
+    if(collected > 0)
+    {
+        info->block = blocks[collected - 1];
+        info->block_index = first + collected - 1;
+    }
+
+    return collected;
+}
+
+//Read or write numBlocks data blocks from/to buf, issuing a single transfer
+//for each run of adjacent blocks
+static int transferBlocks(const uint32_t *blocks, int numBlocks, uint8_t *buf, int write)
+{
+    int start = 0;
+
+    while(start < numBlocks)
+    {
+        int run = 1;
+
+        //Extend the run while the next block directly follows on disk
+        while(start + run < numBlocks && blocks[start + run] == blocks[start] + run)
+            run++;
+
+        size_t diskBlock = blocks[start] + mounteddisk->geo.datastartindex;
+        int ret;
+
+        if(write)
+            ret = cache_write_range(diskBlock, run, &buf[start * BLOCK_SIZE]);
+        else
+            ret = cache_read_range(diskBlock, run, &buf[start * BLOCK_SIZE]);
+
+        if(ret != SUCCESS)
+            return FAILURE;
+
+        start += run;
+    }
+
+    return SUCCESS;
+}
+
+//Read or write len bytes at offset blockOffset of data block block through
+//info's bounce buffer. For writes, the rest of the block is preserved if the
+//block (logical block index of the file) holds data
+static int transferPartial(Fileinfo *info, int block, int index, size_t blockOffset,
+                           size_t len, uint8_t *buf, int write)
+{
+    size_t diskBlock = block + mounteddisk->geo.datastartindex;
+
+    if(info->bounce == NULL)
+    {
+        info->bounce = malloc(BLOCK_SIZE);
+
+        if(info->bounce == NULL)
+            return FAILURE;
+    }
+
+    //Only blocks within the file have content worth reading
+    if(!write || (size_t) index * BLOCK_SIZE < fileSize(info->root))
+    {
+        if(cache_read(diskBlock, info->bounce) != SUCCESS)
+            return FAILURE;
+    }
+    else
+        memset(info->bounce, 0, BLOCK_SIZE);
+
+    if(!write)
+    {
+        memcpy(buf, &info->bounce[blockOffset], len);
+        return SUCCESS;
+    }
+
+    memcpy(&info->bounce[blockOffset], buf, len);
+
+    return cache_write(diskBlock, info->bounce);
+}
+
+//Read or write count bytes at offset of info's file from/to buf, extending the
+//file for writes. Whole blocks are transferred directly between buf and the
+//disk, only partial first and last blocks go through the bounce buffer.
+//Returns the number of bytes transferred, which is smaller than count if the
+//end of the file is reached (or the disk is full when writing)
+static int transferFile(Fileinfo *info, uint8_t *buf, size_t count, size_t offset, int write)
+{
+    uint32_t blocks[BATCH_BLOCKS];
+    size_t done = 0;
+
+    while(done < count)
+    {
+        size_t position = offset + done;
+        int first = position / BLOCK_SIZE;
+        size_t blockOffset = position % BLOCK_SIZE;
+        size_t numBlocks = (blockOffset + count - done + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        //Find the data blocks of the next batch, extending the file for writes
+        if(numBlocks > BATCH_BLOCKS)
+            numBlocks = BATCH_BLOCKS;
+
+        int available = collectBlocks(info, first, numBlocks, write, blocks);
+
+        if(available == 0)
+            break;
+
+        int i = 0;
+
+        while(i < available && done < count)
+        {
+            size_t len = count - done;
+
+            //Partial block, through the bounce buffer
+            if(blockOffset != 0 || len < BLOCK_SIZE)
+            {
+                if(len > BLOCK_SIZE - blockOffset)
+                    len = BLOCK_SIZE - blockOffset;
+
+                if(transferPartial(info, blocks[i], first + i, blockOffset, len, &buf[done], write) != SUCCESS)
+                    return FAILURE;
+
+                done += len;
+                blockOffset = 0;
+                i++;
+                continue;
+            }
+
+            //Whole blocks, straight from/to the caller's buffer
+            int whole = available - i;
+
+            if((size_t) whole > len / BLOCK_SIZE)
+                whole = len / BLOCK_SIZE;
+
+            if(transferBlocks(&blocks[i], whole, &buf[done], write) != SUCCESS)
+                return FAILURE;
+
+            done += whole * BLOCK_SIZE;
+            i += whole;
+        }
+
+        //The chain ended (or the disk is full)
+        if((size_t) available < numBlocks)
+            break;
+    }
+
+    return done;
+}
+
+//Write the appends buffered by a file of a lock to its last block. Called with
+//the lock held for writing
+static int flushStripe(int stripe)
+{
+    int fd = mounteddisk->appendFd[stripe];
+
+    if(fd == NO_FD)
+        return SUCCESS;
+
+    Fileinfo *info = fdInfo(fd);
+
+    mounteddisk->appendFd[stripe] = NO_FD;
+
+    //The rest of the block is past the end of the file
+    memset(&info->wbuf[info->wbuf_len], 0, BLOCK_SIZE - info->wbuf_len);
+
+    return cache_write(info->wbuf_block + mounteddisk->geo.datastartindex, info->wbuf);
+}
+
+//Write a file's buffered appends, or those of another file sharing its lock.
+//Called with the file's lock held for writing
+static int flushAppends(Rootentry *file)
+{
+    return flushStripe(fileStripe(file));
+}
+
+//Lock a file for reading, once its buffered appends (if any) are written
+static void lockFileRead(Rootentry *file)
+{
+    pthread_rwlock_rdlock(fileLock(file));
+
+    while(*appendFd(file) != NO_FD)
+    {
+        pthread_rwlock_unlock(fileLock(file));
+        pthread_rwlock_wrlock(fileLock(file));
+        flushAppends(file);
+        pthread_rwlock_unlock(fileLock(file));
+        pthread_rwlock_rdlock(fileLock(file));
+    }
+}
+
+//Append count bytes of buf to info's file (small writes at the end of the
+//file) in the fd's buffer holding the last block of the file. The buffer is
+//written when the block is full, or when the file is accessed otherwise.
+//Called with the file's lock held for writing, returns the number of bytes
+//appended
+static int bufferAppend(int fd, const uint8_t *buf, size_t count)
+{
+    Fileinfo *info = fdInfo(fd);
+    Rootentry *file = info->root;
+    size_t done = 0;
+
+    if(info->wbuf == NULL)
+    {
+        info->wbuf = malloc(BLOCK_SIZE);
+
+        if(info->wbuf == NULL)
+            return FAILURE;
+    }
+
+    while(done < count)
+    {
+        //Start buffering the last block, making sure it exists
+        if(*appendFd(file) != fd)
+        {
+            size_t size = fileSize(file);
+            uint32_t block;
+
+            if(collectBlocks(info, size / BLOCK_SIZE, 1, 1, &block) != 1)
+                break;
+
+            if(size % BLOCK_SIZE != 0 && cache_read(block + mounteddisk->geo.datastartindex, info->wbuf) != SUCCESS)
+                return FAILURE;
+
+            info->wbuf_block = block;
+            info->wbuf_len = size % BLOCK_SIZE;
+            *appendFd(file) = fd;
+        }
+
+        size_t len = count - done;
+
+        if(len > BLOCK_SIZE - info->wbuf_len)
+            len = BLOCK_SIZE - info->wbuf_len;
+
+        memcpy(&info->wbuf[info->wbuf_len], &buf[done], len);
+        info->wbuf_len += len;
+        setFileSize(file, fileSize(file) + len);
+        markEntryDirty(file);
+        done += len;
+
+        //A full block goes out at once
+        if(info->wbuf_len == BLOCK_SIZE && flushAppends(file) != SUCCESS)
+            return FAILURE;
+    }
+
+    return done;
+}
+
+//Read ahead of a sequential reader of info's file that just read count bytes
+//at offset. The window grows (twice as large, and at least twice the size of
+//the reads) each time the reader gets halfway through the last one
+static void readAhead(Fileinfo *info, size_t offset, size_t count)
+{
+    uint32_t blocks[BATCH_BLOCKS];
+    int sequential = offset == info->ra_next;
+
+    info->ra_next = offset + count;
+
+    //A jump ends the sequential run
+    if(!sequential)
+    {
+        info->ra_window = 0;
+        info->ra_end = 0;
+        return;
+    }
+
+    if(mounteddisk->readahead == 0 || count == 0)
+        return;
+
+    int last = (offset + count - 1) / BLOCK_SIZE;
+    int readBlocks = last - offset / BLOCK_SIZE + 1;
+
+    if(info->ra_window > 0 && last + info->ra_window / 2 < info->ra_end)
+        return;
+
+    //Grow the window
+    int window = info->ra_window == 0 ? READAHEAD_MIN_BLOCKS : 2 * info->ra_window;
+
+    if(window < 2 * readBlocks)
+        window = 2 * readBlocks;
+
+    if(window > mounteddisk->readahead)
+        window = mounteddisk->readahead;
+
+    info->ra_window = window;
+
+    //Stop at the end of the file
+    int first = info->ra_end > last ? info->ra_end : last + 1;
+    int fileBlocks = (fileSize(info->root) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int numBlocks = first + window > fileBlocks ? fileBlocks - first : window;
+
+    if(numBlocks <= 0)
+        return;
+
+    //The reader's cursor stays where the read ended
+    int32_t cursor = info->block;
+    int32_t cursorIndex = info->block_index;
+
+    numBlocks = collectBlocks(info, first, numBlocks, 0, blocks);
+
+    info->block = cursor;
+    info->block_index = cursorIndex;
+    info->ra_end = first + numBlocks;
+
+    //Queue one read per run of adjacent blocks
+    int start = 0;
+
+    while(start < numBlocks)
+    {
+        int run = 1;
+
+        while(start + run < numBlocks && blocks[start + run] == blocks[start] + run)
+            run++;
+
+        cache_prefetch(blocks[start] + mounteddisk->geo.datastartindex, run);
+
+        start += run;
+    }
+}
+
+//Check if char ptr is string (null-terminated)
+static int isString(const char *ptr)
+{
+    while(*ptr)
+        ptr++;
+
+    if(*ptr != '\0')
+        return FAILURE;
+
+    else
+        return SUCCESS;
+
+}
+
+//Check if root directory entry is free
+static int rootEntryFree(Rootentry entry)
+{
+    if(entry.filename[0] != '\0')
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Hash a filename (FNV-1a)
+static uint32_t hashFilename(const char *filename)
+{
+    uint32_t hash = 2166136261u;
+
+    for(int i = 0; i < ROOT_FILENAME_SIZE && filename[i] != '\0'; i++)
+    {
+        hash ^= (uint8_t) filename[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+//Get entry number entry of a directory
+static Rootentry *dirEntry(Directory *dir, int entry)
+{
+    if(dir->entry == NULL)
+        return &mounteddisk->root->entries[entry];
+
+    return &dir->blocks[entry / DIR_BLOCK_ENTRIES]->entries[entry % DIR_BLOCK_ENTRIES];
+}
+
+//Get the index slot holding filename, or the empty slot where it would go
+static int indexSlot(Directory *dir, const char *filename)
+{
+    Dirindex *index = &dir->index;
+    int slot = hashFilename(filename) & index->mask;
+
+    //Linear probing
+    while(index->slots[slot] != NO_ENTRY)
+    {
+        char *currfile = (char *) dirEntry(dir, index->slots[slot])->filename;
+
+        if(strncmp(currfile, filename, ROOT_FILENAME_SIZE) == 0)
+            break;
+
+        slot = (slot + 1) & index->mask;
+    }
+
+    return slot;
+}
+
+//Add entry to the index (its filename must already be set)
+static void indexInsert(Directory *dir, int entry)
+{
+    Dirindex *index = &dir->index;
+    int slot = indexSlot(dir, (char *) dirEntry(dir, entry)->filename);
+
+    index->slots[slot] = entry;
+    index->freeEntries[entry / 64] &= ~(1ULL << (entry % 64));
+    index->numFiles++;
+}
+
+//Remove entry from the index (its filename must still be set)
+static void indexRemove(Directory *dir, int entry)
+{
+    Dirindex *index = &dir->index;
+    int slot = indexSlot(dir, (char *) dirEntry(dir, entry)->filename);
+    int next = slot;
+
+    index->slots[slot] = NO_ENTRY;
+
+    //Shift back the following entries of the probe sequence to fill the hole
+    while(1)
+    {
+        next = (next + 1) & index->mask;
+
+        if(index->slots[next] == NO_ENTRY)
+            break;
+
+        int home = hashFilename((char *) dirEntry(dir, index->slots[next])->filename) & index->mask;
+
+        //Move the entry only if the hole lies between its home slot and next
+        if(((next - home) & index->mask) >= ((next - slot) & index->mask))
+        {
+            index->slots[slot] = index->slots[next];
+            index->slots[next] = NO_ENTRY;
+            slot = next;
+        }
+    }
+
+    index->freeEntries[entry / 64] |= 1ULL << (entry % 64);
+    index->numFiles--;
+
+    if(entry / 64 < index->freeHint)
+        index->freeHint = entry / 64;
+}
+
+//Check if an entry of a directory can hold a file: the first entry of each
+//block of a subdirectory holds the block's bookkeeping
+static int usableEntry(Directory *dir, int entry)
+{
+    return dir->entry == NULL || entry % DIR_BLOCK_ENTRIES != 0;
+}
+
+//Build the index of a directory of numEntries entries
+static int indexBuild(Directory *dir, int numEntries)
+{
+    Dirindex *index = &dir->index;
+    int numSlots = 1;
+
+    //Keep the table at most half full
+    while(numSlots < 2 * numEntries)
+        numSlots <<= 1;
+
+    index->slots = malloc(numSlots * sizeof(int));
+    index->freeEntries = calloc((numEntries + 63) / 64, sizeof(uint64_t));
+
+    if(index->slots == NULL || (index->freeEntries == NULL && numEntries > 0))
+        return FAILURE;
+
+    index->mask = numSlots - 1;
+    index->numEntries = numEntries;
+    index->numFiles = 0;
+    index->freeHint = 0;
+
+    for(int i = 0; i < numSlots; i++)
+        index->slots[i] = NO_ENTRY;
+
+    for(int i = 0; i < numEntries; i++)
+    {
+        if(!usableEntry(dir, i))
+            continue;
+
+        index->freeEntries[i / 64] |= 1ULL << (i % 64);
+
+        if(rootEntryFree(*dirEntry(dir, i)) != SUCCESS)
+            indexInsert(dir, i);
+    }
+
+    return SUCCESS;
+}
+
+//Add the entries of a new block of a directory to its index, all free. The
+//table doubles when it gets more than half full, so that adding entries one
+//block at a time takes constant time per entry
+static int indexGrow(Directory *dir, int numEntries)
+{
+    Dirindex *index = &dir->index;
+    int oldWords = (index->numEntries + 63) / 64;
+    int words = (numEntries + 63) / 64;
+    uint64_t *freeEntries = realloc(index->freeEntries, words * sizeof(uint64_t));
+
+    if(freeEntries == NULL)
+        return FAILURE;
+
+    index->freeEntries = freeEntries;
+    memset(&freeEntries[oldWords], 0, (words - oldWords) * sizeof(uint64_t));
+
+    if(2 * numEntries > index->mask + 1)
+    {
+        int numSlots = 2 * (index->mask + 1);
+        int *oldSlots = index->slots;
+        int oldMask = index->mask;
+
+        while(numSlots < 2 * numEntries)
+            numSlots <<= 1;
+
+        index->slots = malloc(numSlots * sizeof(int));
+
+        if(index->slots == NULL)
+        {
+            index->slots = oldSlots;
+            return FAILURE;
+        }
+
+        index->mask = numSlots - 1;
+
+        for(int i = 0; i < numSlots; i++)
+            index->slots[i] = NO_ENTRY;
+
+        for(int i = 0; i <= oldMask; i++)
+        {
+            if(oldSlots[i] != NO_ENTRY)
+                index->slots[indexSlot(dir, (char *) dirEntry(dir, oldSlots[i])->filename)] = oldSlots[i];
+        }
+
+        free(oldSlots);
+    }
+
+    for(int i = index->numEntries; i < numEntries; i++)
+    {
+        if(usableEntry(dir, i))
+            index->freeEntries[i / 64] |= 1ULL << (i % 64);
+    }
+
+    if(oldWords < index->freeHint)
+        index->freeHint = oldWords;
+
+    index->numEntries = numEntries;
+
+    return SUCCESS;
+}
+
+//Free the index of a directory
+static void indexFree(Dirindex *index)
+{
+    free(index->slots);
+    free(index->freeEntries);
+    index->slots = NULL;
+    index->freeEntries = NULL;
+}
+
+//Get the number of empty entries in root directory
+static int numEmptyEntriesRootDir()
+{
+    return ROOT_ENTRIES - mounteddisk->rootdir.index.numFiles;
+}
+
+//Get the number of files in the root directory
+static int numFilesRootDir()
+{
+    return mounteddisk->rootdir.index.numFiles;
+}
+
+//Get the first free entry of a directory, NO_ENTRY if it is full. The words of
+//the bitmap before the hint have no free entry
+static int findNextEmpty(Directory *dir)
+{
+    Dirindex *index = &dir->index;
+
+    for(int i = index->freeHint; i < (index->numEntries + 63) / 64; i++)
+    {
+        if(index->freeEntries[i] != 0)
+        {
+            index->freeHint = i;
+            return i * 64 + __builtin_ctzll(index->freeEntries[i]);
+        }
+    }
+
+    index->freeHint = (index->numEntries + 63) / 64;
+
+    return NO_ENTRY;
+}
+
+//Search for file in a directory, returns its entry number or NO_ENTRY
+static int findFile(Directory *dir, const char *filename)
+{
+    return dir->index.slots[indexSlot(dir, filename)];
+}
+
+//Check if file name is valid
+static int validFilename(const char *filename)
+{
+
+    //Check for invalid filename errors
+
+    //Case 1: Filename not null-terminated
+    if(isString(filename) != SUCCESS)
+        return FAILURE;
+
+    //Case 2: Filename length exceeds maximum (including the NULL character)
+    if(strlen(filename) >= FS_FILENAME_LEN)
+        return FAILURE;
+
+    //Case 3: Empty filename (marks a free entry)
+    if(filename[0] == '\0')
+        return FAILURE;
+    
+    
+
+    return SUCCESS;
+}
+
+//Check if file table has space
+static int fileTableSpaceAvailable()
+{
+    if(freeFds == NO_FD && numFds == maxFds)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Check if the file of an entry of a directory has an open file descriptor
+static int fileIsOpen(Directory *dir, int entry)
+{
+    if(dir->open[entry] == NULL)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Check if fd is open
+static int isOpen(int fd)
+{
+    if(fdInfo(fd)->open != 1)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Check if file descriptor is within bounds
+static int fd_in_bounds(int fd)
+{
+    if(fd >= __atomic_load_n(&numFds, __ATOMIC_ACQUIRE))
+        return FAILURE;
+
+    if(fd < 0)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Check to make sure file descriptor is valid
+static int valid_fd(int fd)
+{
+    //Case 1: fd not in bounds
+    if(fd_in_bounds(fd) != SUCCESS)
+        return FAILURE;
+
+    //Case 2: fd not open
+    if(isOpen(fd) != SUCCESS)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Lock fd, making sure it is valid (in bounds and open)
+static int lockFd(int fd)
+{
+    if(fd_in_bounds(fd) != SUCCESS)
+        return FAILURE;
+
+    pthread_mutex_lock(&fdInfo(fd)->lock);
+
+    if(isOpen(fd) != SUCCESS)
+    {
+        pthread_mutex_unlock(&fdInfo(fd)->lock);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+//Set up view as a private copy of fd's cursor, so that a positional transfer
+//can proceed without holding the descriptor. Partial blocks go through bounce
+static int viewFd(int fd, Fileinfo *view, uint8_t *bounce)
+{
+    if(lockFd(fd) != SUCCESS)
+        return FAILURE;
+
+    view->root = fdInfo(fd)->root;
+    view->block = fdInfo(fd)->block;
+    view->block_index = fdInfo(fd)->block_index;
+    view->map = NULL;
+    view->bounce = bounce;
+
+    pthread_mutex_unlock(&fdInfo(fd)->lock);
+
+    return SUCCESS;
+}
+
+//Check for seek errors
+static int lseek_err_check(int fd, size_t offset)
+{
+    //Case 1: invalid fd
+    if(valid_fd(fd) != SUCCESS)
+        return FAILURE;
+
+    //Case 2: offset out of bounds
+    if(offset > fileSize(fdInfo(fd)->root))
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Find the directory holding the last name of a path, whose names are
+//separated by PATH_SEPARATOR, and copy that name to name. Returns NULL if a
+//name is not valid, or if one of the names before the last is not a directory
+static Directory *resolvePath(const char *path, char *name)
+{
+    Directory *dir = &mounteddisk->rootdir;
+
+    if(isString(path) != SUCCESS)
+        return NULL;
+
+    //Paths start from the root directory, with or without a separator
+    if(*path == PATH_SEPARATOR)
+        path++;
+
+    while(1)
+    {
+        const char *end = strchr(path, PATH_SEPARATOR);
+        size_t length = end != NULL ? (size_t) (end - path) : strlen(path);
+
+        if(length >= FS_FILENAME_LEN)
+            return NULL;
+
+        memcpy(name, path, length);
+        name[length] = '\0';
+
+        if(validFilename(name) != SUCCESS)
+            return NULL;
+
+        if(end == NULL)
+            return dir;
+
+        int entry = findFile(dir, name);
+
+        if(entry == NO_ENTRY || dir->subdirs[entry] == NULL)
+            return NULL;
+
+        dir = dir->subdirs[entry];
+        path = end + 1;
+    }
+}
+
+//Check if a path names an entry of a subdirectory
+static int inSubdirectory(const char *path)
+{
+    if(*path == PATH_SEPARATOR)
+        path++;
+
+    return strchr(path, PATH_SEPARATOR) != NULL;
+}
+
+//Check for file opening errors, on the directory and name found by resolvePath()
+static int open_err_check(Directory *dir, const char *filename)
+{
+    //Case 1: Invalid path
+    if(dir == NULL)
+        return FAILURE;
+
+    int entry = findFile(dir, filename);
+
+    //Case 2: Filename not found
+    if(entry == NO_ENTRY)
+        return FAILURE;
+
+    //Case 3: Directories cannot be opened
+    if(dir->subdirs[entry] != NULL)
+        return FAILURE;
+
+    //Case 4: File table full
+    if(fileTableSpaceAvailable() != SUCCESS)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Check for file deletion errors
+static int delete_err_check(Directory *dir, const char *filename)
+{
+    //Case 1: Invalid path
+    if(dir == NULL)
+        return FAILURE;
+
+    int entry = findFile(dir, filename);
+
+    //Case 2: File does not exist
+    if(entry == NO_ENTRY)
+        return FAILURE;
+
+    //Case 3: File is currently open
+    if(fileIsOpen(dir, entry) == SUCCESS)
+        return FAILURE;
+
+    //Case 4: Directory is not empty
+    if(dir->subdirs[entry] != NULL && dir->subdirs[entry]->index.numFiles > 0)
+        return FAILURE;
+
+    //Error check passed
+    return SUCCESS;
+}
+
+//Check for file creation errors
+static int create_err_check(Directory *dir, const char *filename)
+{
+    //Case 1: Invalid path
+    if(dir == NULL)
+        return FAILURE;
+
+    //Case 2: No space in root directory (subdirectories grow)
+    if(dir == &mounteddisk->rootdir && numFilesRootDir() == FS_FILE_MAX_COUNT)
+        return FAILURE;
+
+    //Case 3: File already exists
+    if(findFile(dir, filename) != NO_ENTRY)
+        return FAILURE;
+
+    //Error check passed
+    return SUCCESS;
+}
+
+//Write the modified FAT blocks back out to disk
+static int writeFAT()
+{
+    for(int i = 0; i < mounteddisk->geo.numFATBlocks; i++)
+    {
+        if(!mounteddisk->fatDirty[i])
+            continue;
+
+        if(cache_write(FIRST_FAT_BLOCK_INDEX + i, fatBlock(i)) != SUCCESS)
+            return FAILURE;
+
+        mounteddisk->fatDirty[i] = 0;
+    }
+
+    return SUCCESS;
+}
+
+//Write the modified blocks of the extent table back out to disk
+static int writeExtents()
+{
+    if(mounteddisk->extents == NULL)
+        return SUCCESS;
+
+    for(int i = 0; i < ROOT_ENTRIES; i++)
+    {
+        if(!mounteddisk->extentsDirty[i])
+            continue;
+
+        if(cache_write(mounteddisk->geo.extentindex + i, &mounteddisk->extents[i]) != SUCCESS)
+            return FAILURE;
+
+        mounteddisk->extentsDirty[i] = 0;
+    }
+
+    return SUCCESS;
+}
+
+//Copy a block of a subdirectory as it is on disk, without its bookkeeping
+static void copyDirBlock(uint8_t *buf, const Dirblock *block)
+{
+    memcpy(buf, block, BLOCK_SIZE);
+    memset(buf, 0, sizeof(Rootentry));
+}
+
+//Free the blocks of the deleted subdirectories, dropping them from the list of
+//modified blocks. Called with the metadata locked, when no commit can be
+//writing them
+static void freeDeadBlocks()
+{
+    int numDirty = 0;
+
+    pthread_mutex_lock(&mounteddisk->dirtyLock);
+
+    for(int i = 0; i < mounteddisk->numDirty; i++)
+    {
+        if(!mounteddisk->dirtyBlocks[i]->header.dead)
+            mounteddisk->dirtyBlocks[numDirty++] = mounteddisk->dirtyBlocks[i];
+    }
+
+    mounteddisk->numDirty = numDirty;
+
+    while(mounteddisk->deadBlocks != NULL)
+    {
+        Dirblock *block = mounteddisk->deadBlocks;
+
+        mounteddisk->deadBlocks = block->header.nextDead;
+        mounteddisk->numDirBlocks--;
+        free(block);
+    }
+
+    pthread_mutex_unlock(&mounteddisk->dirtyLock);
+}
+
+//Write the modified blocks of subdirectories back out to disk. Called with the
+//metadata locked
+static int writeDirBlocks()
+{
+    uint8_t buf[BLOCK_SIZE];
+
+    freeDeadBlocks();
+
+    while(mounteddisk->numDirty > 0)
+    {
+        Dirblock *block = mounteddisk->dirtyBlocks[mounteddisk->numDirty - 1];
+
+        copyDirBlock(buf, block);
+
+        if(cache_write(block->header.block + mounteddisk->geo.datastartindex, buf) != SUCCESS)
+            return FAILURE;
+
+        block->header.dirty = 0;
+        mounteddisk->numDirty--;
+    }
+
+    return SUCCESS;
+}
+
+//Write the modified metadata back out to disk (the superblock only changes when
+//a journal is created, which writes it)
+static int writeBlocks()
+{
+    //Subdirectories are copied in memory, even from a mapped disk
+    if(writeDirBlocks() != SUCCESS)
+        return FAILURE;
+
+    //A mapped disk's metadata is already modified in place
+    if(mounteddisk->mapped)
+        return SUCCESS;
+
+    //Write the FAT
+    if(writeFAT() != SUCCESS)
+        return FAILURE;
+
+    //Write the root directory
+    if(mounteddisk->rootDirty)
+    {
+        if(cache_write(mounteddisk->geo.rootindex, mounteddisk->root) != SUCCESS)
+            return FAILURE;
+
+        mounteddisk->rootDirty = 0;
+    }
+
+    //Write the extents of the files
+    return writeExtents();
+}
+
+//Stop every change of the metadata: directory operations, writers of every
+//file (after their buffered appends are flushed), and the block allocator
+static void lockMetadata()
+{
+    //Writers update the sizes in the directories under their file's lock
+    pthread_rwlock_wrlock(&mounteddisk->dirLock);
+
+    for(int i = 0; i < FILE_LOCKS; i++)
+    {
+        pthread_rwlock_wrlock(&mounteddisk->fileLocks[i]);
+        flushStripe(i);
+        pthread_rwlock_unlock(&mounteddisk->fileLocks[i]);
+    }
+
+    for(int i = 0; i < FILE_LOCKS; i++)
+        pthread_rwlock_rdlock(&mounteddisk->fileLocks[i]);
+    pthread_mutex_lock(&mounteddisk->fatLock);
+}
+
+static void unlockMetadata()
+{
+    pthread_mutex_unlock(&mounteddisk->fatLock);
+    for(int i = 0; i < FILE_LOCKS; i++)
+        pthread_rwlock_unlock(&mounteddisk->fileLocks[i]);
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
+}
+
+//Decode the layout of a disk from its superblock, of either version. Fails if
+//the signature is unknown, or if the layout is not consistent
+static int readGeometry(const void *block, Geometry *geo)
+{
+    const Superblock *superblock = block;
+    const Superblock2 *superblock2 = block;
+
+    if(memcmp(superblock->signature, FS_SIGNATURE, SIGNATURE_BYTES) == 0)
+    {
+        geo->version = 1;
+        geo->fatBits = 16;
+        geo->extents = 0;
+        geo->extentindex = 0;
+        geo->numBlocks = superblock->numBlocks;
+        geo->rootindex = superblock->rootindex;
+        geo->datastartindex = superblock->datastartindex;
+        geo->numDataBlocks = superblock->numDataBlocks;
+        geo->numFATBlocks = (uint8_t) superblock->numFATBlocks;
+        geo->journal = memcmp(superblock->journalSignature, JOURNAL_SIGNATURE, SIGNATURE_BYTES) == 0;
+        geo->journalStart = superblock->journalStart;
+        geo->journalBlocks = superblock->journalBlocks;
+    }
+    else if(memcmp(superblock2->signature, FS2_SIGNATURE, SIGNATURE_BYTES) == 0)
+    {
+        uint32_t numBlocks = superblock2->numBlocks;
+
+        //Every field is a number of blocks or a block of the disk
+        if(numBlocks > INT32_MAX || superblock2->rootindex > numBlocks || superblock2->datastartindex > numBlocks
+           || superblock2->numDataBlocks > numBlocks || superblock2->numFATBlocks > numBlocks
+           || superblock2->journalStart > numBlocks || superblock2->journalBlocks > numBlocks
+           || superblock2->extentindex > numBlocks || (superblock2->features & ~FS2_FEATURE_EXTENTS) != 0)
+            return FAILURE;
+
+        geo->version = 2;
+        geo->extents = (superblock2->features & FS2_FEATURE_EXTENTS) != 0;
+        geo->fatBits = geo->extents ? 1 : 32;
+        geo->extentindex = superblock2->extentindex;
+        geo->numBlocks = numBlocks;
+        geo->rootindex = superblock2->rootindex;
+        geo->datastartindex = superblock2->datastartindex;
+        geo->numDataBlocks = superblock2->numDataBlocks;
+        geo->numFATBlocks = superblock2->numFATBlocks;
+        geo->journal = memcmp(superblock2->journalSignature, JOURNAL_SIGNATURE, SIGNATURE_BYTES) == 0;
+        geo->journalStart = superblock2->journalStart;
+        geo->journalBlocks = superblock2->journalBlocks;
+    }
+    else
+        return FAILURE;
+
+    //The FAT covers every data block, and the metadata comes before them
+    if(geo->numFATBlocks < 1 || geo->numDataBlocks < 1
+       || (int64_t) geo->numFATBlocks * (BLOCK_SIZE * 8 / geo->fatBits) < geo->numDataBlocks
+       || geo->rootindex <= geo->numFATBlocks || geo->datastartindex <= geo->rootindex
+       || (int64_t) geo->datastartindex + geo->numDataBlocks > geo->numBlocks)
+        return FAILURE;
+
+    //The extent table sits between the root directory and the data blocks
+    if(geo->extents && (geo->extentindex <= geo->rootindex || geo->extentindex + ROOT_ENTRIES > geo->datastartindex))
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Encode the layout of a disk in its superblock, in the format of its version
+static void writeGeometry(void *block, const Geometry *geo)
+{
+    Superblock *superblock = block;
+    Superblock2 *superblock2 = block;
+
+    if(geo->version == 2)
+    {
+        memcpy(superblock2->signature, FS2_SIGNATURE, SIGNATURE_BYTES);
+        superblock2->numBlocks = geo->numBlocks;
+        superblock2->rootindex = geo->rootindex;
+        superblock2->datastartindex = geo->datastartindex;
+        superblock2->numDataBlocks = geo->numDataBlocks;
+        superblock2->numFATBlocks = geo->numFATBlocks;
+
+        if(geo->journal)
+            memcpy(superblock2->journalSignature, JOURNAL_SIGNATURE, SIGNATURE_BYTES);
+
+        superblock2->journalStart = geo->journalStart;
+        superblock2->journalBlocks = geo->journalBlocks;
+        superblock2->features = geo->extents ? FS2_FEATURE_EXTENTS : 0;
+        superblock2->extentindex = geo->extentindex;
+        return;
+    }
+
+    memcpy(superblock->signature, FS_SIGNATURE, SIGNATURE_BYTES);
+    superblock->numBlocks = geo->numBlocks;
+    superblock->rootindex = geo->rootindex;
+    superblock->datastartindex = geo->datastartindex;
+    superblock->numDataBlocks = geo->numDataBlocks;
+    superblock->numFATBlocks = geo->numFATBlocks;
+
+    if(geo->journal)
+        memcpy(superblock->journalSignature, JOURNAL_SIGNATURE, SIGNATURE_BYTES);
+
+    superblock->journalStart = geo->journalStart;
+    superblock->journalBlocks = geo->journalBlocks;
+}
+
+//FNV-1a hash of a buffer, continuing from hash
+static uint64_t checksum(uint64_t hash, const uint8_t *buf, size_t len)
+{
+    for(size_t i = 0; i < len; i++)
+        hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+//Checksum of a commit, whose checksum field is ignored
+static uint64_t commitChecksum(uint8_t *commit)
+{
+    Commitheader *header = (Commitheader *) commit;
+    uint64_t saved = header->checksum;
+
+    header->checksum = 0;
+    uint64_t hash = checksum(0xcbf29ce484222325ULL, commit, (header->numBlocks + 1) * BLOCK_SIZE);
+    header->checksum = saved;
+
+    return hash;
+}
+
+//Number of metadata blocks that a commit can hold: the FAT, the root directory
+//and the extent table if the disk has one
+static int metadataBlocks(const Geometry *geo)
+{
+    return geo->numFATBlocks + 1 + (geo->extents ? ROOT_ENTRIES : 0);
+}
+
+//Number of blocks of subdirectories that a commit can hold: up to
+//JOURNAL_DIR_BLOCKS, fewer on small disks and as many as the header can list.
+//A disk with extents has no subdirectories
+static int journalDirBlocks(const Geometry *geo)
+{
+    int blocks = geo->numDataBlocks / 64;
+
+    if(geo->extents)
+        return 0;
+
+    if(blocks < DIR_OP_BLOCKS)
+        blocks = DIR_OP_BLOCKS;
+
+    if(blocks > JOURNAL_DIR_BLOCKS)
+        blocks = JOURNAL_DIR_BLOCKS;
+
+    if(blocks > (int) COMMIT_MAX_BLOCKS - metadataBlocks(geo))
+        blocks = (int) COMMIT_MAX_BLOCKS - metadataBlocks(geo);
+
+    return blocks;
+}
+
+//Get the first disk block and the slot size of a disk's journal. Fails if the
+//disk has no journal, or if it does not fit in the disk
+static int journalLayout(Geometry *geo, int *start, int *slotBlocks)
+{
+    if(!geo->journal)
+        return FAILURE;
+
+    *start = geo->datastartindex + geo->journalStart;
+    *slotBlocks = geo->journalBlocks / JOURNAL_SLOTS;
+
+    //A slot holds a header, every metadata block and the blocks of
+    //subdirectories, and the header lists the other blocks
+    if(geo->journalStart < 0 || *slotBlocks < metadataBlocks(geo) + 1 + journalDirBlocks(geo)
+       || *slotBlocks - 1 > (int) COMMIT_MAX_BLOCKS
+       || (int64_t) geo->journalStart + geo->journalBlocks > geo->numDataBlocks
+       || (int64_t) *start + geo->journalBlocks > block_disk_count())
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Read the commit held in a slot of the journal. Returns its sequence number,
+//or 0 if the slot does not hold a complete commit
+static uint64_t readCommit(Geometry *geo, int first, int slotBlocks, uint8_t *commit)
+{
+    Commitheader *header = (Commitheader *) commit;
+
+    if(block_read(first, commit) != SUCCESS
+       || memcmp(header->signature, COMMIT_SIGNATURE, SIGNATURE_BYTES) != 0
+       || header->numBlocks == 0 || header->numBlocks >= (uint32_t) slotBlocks
+       || block_read_range(first + 1, header->numBlocks, commit + BLOCK_SIZE) != SUCCESS)
+        return 0;
+
+    //Only metadata blocks and blocks of subdirectories are journaled
+    for(uint32_t i = 0; i < header->numBlocks; i++)
+    {
+        uint32_t block = header->blocks[i];
+        uint32_t journalStart = geo->datastartindex + geo->journalStart;
+        int extent = geo->extents && block >= (uint32_t) geo->extentindex
+                     && block < (uint32_t) geo->extentindex + ROOT_ENTRIES;
+        int data = block >= (uint32_t) geo->datastartindex
+                   && block < (uint32_t) geo->datastartindex + geo->numDataBlocks
+                   && (block < journalStart || block >= journalStart + geo->journalBlocks);
+
+        if(block < FIRST_FAT_BLOCK_INDEX
+           || (block > (uint32_t) geo->numFATBlocks && block != (uint32_t) geo->rootindex && !extent && !data))
+            return 0;
+    }
+
+    //A commit cut short by a crash is ignored
+    if(commitChecksum(commit) != header->checksum)
+        return 0;
+
+    return header->sequence;
+}
+
+//Erase the commits in the journal, once the metadata they hold is on disk
+static int emptyJournal(int start, int slotBlocks)
+{
+    uint8_t empty[BLOCK_SIZE] = {0};
+
+    if(cache_flush() != SUCCESS || block_disk_sync() != SUCCESS)
+        return FAILURE;
+
+    for(int i = 0; i < JOURNAL_SLOTS; i++)
+    {
+        if(block_write(start + i * slotBlocks, empty) != SUCCESS)
+            return FAILURE;
+    }
+
+    return block_disk_sync();
+}
+
+//Bring the metadata of a disk that was not unmounted back to the last commit
+//in its journal, then empty the journal
+static int replayJournal()
+{
+    uint8_t superblock[BLOCK_SIZE];
+    Geometry geo;
+    int start, slotBlocks;
+
+    if(cache_read(SUPERBLOCK_INDEX, superblock) != SUCCESS)
+        return FAILURE;
+
+    //A disk that is not valid is turned down later
+    if(readGeometry(superblock, &geo) != SUCCESS || journalLayout(&geo, &start, &slotBlocks) != SUCCESS)
+        return SUCCESS;
+
+    uint8_t *commits = malloc((size_t) JOURNAL_SLOTS * slotBlocks * BLOCK_SIZE);
+
+    if(commits == NULL)
+        return FAILURE;
+
+    uint8_t *last = NULL;
+    uint64_t lastSequence = 0;
+
+    for(int i = 0; i < JOURNAL_SLOTS; i++)
+    {
+        uint8_t *commit = &commits[(size_t) i * slotBlocks * BLOCK_SIZE];
+        uint64_t sequence = readCommit(&geo, start + i * slotBlocks, slotBlocks, commit);
+
+        if(sequence > lastSequence)
+        {
+            last = commit;
+            lastSequence = sequence;
+        }
+    }
+
+    //A disk that was unmounted has an empty journal
+    if(last == NULL)
+    {
+        free(commits);
+        return SUCCESS;
+    }
+
+    //Write the copies in place
+    Commitheader *header = (Commitheader *) last;
+    int ret = SUCCESS;
+
+    for(uint32_t i = 0; i < header->numBlocks && ret == SUCCESS; i++)
+        ret = cache_write(header->blocks[i], &last[(i + 1) * BLOCK_SIZE]);
+
+    free(commits);
+
+    if(ret != SUCCESS)
+        return FAILURE;
+
+    return emptyJournal(start, slotBlocks);
+}
+
+//Mark the metadata of a commit that could not be written as modified again.
+//Blocks of subdirectories are only clean once written in place
+static void redirtyCommit(Commitheader *header)
+{
+    pthread_mutex_lock(&mounteddisk->fatLock);
+
+    for(uint32_t i = 0; i < header->numBlocks; i++)
+    {
+        int block = header->blocks[i];
+
+        if(block >= mounteddisk->geo.datastartindex)
+            continue;
+        else if(block == mounteddisk->geo.rootindex)
+            markRootDirty();
+        else if(mounteddisk->geo.extents && block >= mounteddisk->geo.extentindex)
+            markExtentsDirty(&mounteddisk->root->entries[block - mounteddisk->geo.extentindex]);
+        else
+            mounteddisk->fatDirty[block - FIRST_FAT_BLOCK_INDEX] = 1;
+    }
+
+    pthread_mutex_unlock(&mounteddisk->fatLock);
+}
+
+//Take the blocks of subdirectories written in place by a commit out of the list
+//of modified blocks, unless they changed since they were copied
+static void cleanDirBlocks(Journal *journal)
+{
+    int numDirty = 0;
+
+    pthread_mutex_lock(&mounteddisk->dirtyLock);
+
+    for(int i = 0; i < journal->numDirBlocks; i++)
+    {
+        Dirheader *header = &journal->dirBlocks[i]->header;
+
+        if(!header->dead && header->version == journal->dirVersions[i])
+            header->dirty = 0;
+    }
+
+    for(int i = 0; i < mounteddisk->numDirty; i++)
+    {
+        if(mounteddisk->dirtyBlocks[i]->header.dirty)
+            mounteddisk->dirtyBlocks[numDirty++] = mounteddisk->dirtyBlocks[i];
+    }
+
+    mounteddisk->numDirty = numDirty;
+
+    pthread_mutex_unlock(&mounteddisk->dirtyLock);
+}
+
+//Write the metadata modified since the last commit to the journal, make it
+//durable along with every block written so far, then write it in place
+static int commitJournal()
+{
+    Journal *journal = mounteddisk->journal;
+    Commitheader *header = (Commitheader *) journal->slot;
+    uint32_t count = 0;
+
+    //Take a copy of the modified metadata blocks
+    lockMetadata();
+    freeDeadBlocks();
+
+    //Directory operations and writers reserve room for the blocks of
+    //subdirectories they modify
+    if(mounteddisk->numDirty > journal->dirRoom)
+    {
+        unlockMetadata();
+        return FAILURE;
+    }
+
+    for(int i = 0; i < mounteddisk->geo.numFATBlocks; i++)
+    {
+        if(!mounteddisk->fatDirty[i])
+            continue;
+
+        memcpy(&journal->slot[(count + 1) * BLOCK_SIZE], fatBlock(i), BLOCK_SIZE);
+        header->blocks[count++] = FIRST_FAT_BLOCK_INDEX + i;
+        mounteddisk->fatDirty[i] = 0;
+    }
+
+    if(mounteddisk->rootDirty)
+    {
+        memcpy(&journal->slot[(count + 1) * BLOCK_SIZE], mounteddisk->root, BLOCK_SIZE);
+        header->blocks[count++] = mounteddisk->geo.rootindex;
+        __atomic_store_n(&mounteddisk->rootDirty, 0, __ATOMIC_RELAXED);
+    }
+
+    for(int i = 0; mounteddisk->extents != NULL && i < ROOT_ENTRIES; i++)
+    {
+        if(!mounteddisk->extentsDirty[i])
+            continue;
+
+        memcpy(&journal->slot[(count + 1) * BLOCK_SIZE], &mounteddisk->extents[i], BLOCK_SIZE);
+        header->blocks[count++] = mounteddisk->geo.extentindex + i;
+        __atomic_store_n(&mounteddisk->extentsDirty[i], 0, __ATOMIC_RELAXED);
+    }
+
+    //They stay in the list of modified blocks until written in place
+    journal->numDirBlocks = 0;
+
+    for(int i = 0; i < mounteddisk->numDirty; i++)
+    {
+        Dirblock *block = mounteddisk->dirtyBlocks[i];
+
+        copyDirBlock(&journal->slot[(count + 1) * BLOCK_SIZE], block);
+        header->blocks[count++] = block->header.block + mounteddisk->geo.datastartindex;
+        journal->dirBlocks[journal->numDirBlocks] = block;
+        journal->dirVersions[journal->numDirBlocks++] = block->header.version;
+    }
+
+    header->numBlocks = count;
+
+    unlockMetadata();
+
+    //Only the last commit is replayed after a crash, so the metadata written in
+    //place by the previous one has to be durable before this one is. It goes
+    //out with the data
+    int ret = cache_flush();
+
+    if(ret == SUCCESS)
+        ret = block_disk_sync();
+
+    if(ret == SUCCESS && count > 0)
+    {
+        memcpy(header->signature, COMMIT_SIGNATURE, SIGNATURE_BYTES);
+        header->sequence = journal->sequence;
+        header->checksum = commitChecksum(journal->slot);
+
+        int first = journal->start + (journal->sequence % JOURNAL_SLOTS) * journal->slotBlocks;
+
+        ret = block_write_range(first, count + 1, journal->slot);
+
+        if(ret == SUCCESS)
+            ret = block_disk_sync();
+    }
+
+    if(ret != SUCCESS)
+    {
+        redirtyCommit(header);
+        return FAILURE;
+    }
+
+    if(count == 0)
+        return SUCCESS;
+
+    journal->sequence++;
+
+    //The commit is safe: the metadata can now reach its place on disk at any time
+    uint32_t numMetadata = count - journal->numDirBlocks;
+
+    for(uint32_t i = 0; i < numMetadata && ret == SUCCESS; i++)
+        ret = cache_write(header->blocks[i], &journal->slot[(i + 1) * BLOCK_SIZE]);
+
+    //The block of a directory deleted since it was copied may already hold a file
+    pthread_rwlock_rdlock(&mounteddisk->dirLock);
+
+    for(int i = 0; i < journal->numDirBlocks && ret == SUCCESS; i++)
+    {
+        if(!journal->dirBlocks[i]->header.dead)
+            ret = cache_write(header->blocks[numMetadata + i], &journal->slot[(numMetadata + i + 1) * BLOCK_SIZE]);
+    }
+
+    if(ret == SUCCESS)
+        cleanDirBlocks(journal);
+
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
+
+    //Commit it again next time
+    if(ret != SUCCESS)
+        redirtyCommit(header);
+
+    return ret;
+}
+
+//Commit the journal. Callers arriving while a commit is written wait for the
+//next one, which is then shared by all of them
+static int syncJournal()
+{
+    Journal *journal = mounteddisk->journal;
+
+    pthread_mutex_lock(&journal->lock);
+
+    //Only a commit started from now on covers the caller's changes
+    uint64_t needed = journal->started + 1;
+
+    while(journal->finished < needed)
+    {
+        if(journal->running)
+        {
+            pthread_cond_wait(&journal->done, &journal->lock);
+            continue;
+        }
+
+        journal->running = 1;
+        uint64_t commit = ++journal->started;
+        pthread_mutex_unlock(&journal->lock);
+
+        int ret = commitJournal();
+
+        pthread_mutex_lock(&journal->lock);
+        journal->running = 0;
+        journal->finished = commit;
+        journal->result = ret;
+        pthread_cond_broadcast(&journal->done);
+    }
+
+    int ret = journal->result;
+
+    pthread_mutex_unlock(&journal->lock);
+
+    return ret;
+}
+
+//Check if any metadata was modified since the last commit
+static int metadataDirty()
+{
+    int dirty = __atomic_load_n(&mounteddisk->rootDirty, __ATOMIC_RELAXED);
+
+    for(int i = 0; mounteddisk->extents != NULL && i < ROOT_ENTRIES && !dirty; i++)
+        dirty = __atomic_load_n(&mounteddisk->extentsDirty[i], __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&mounteddisk->fatLock);
+
+    for(int i = 0; i < mounteddisk->geo.numFATBlocks && !dirty; i++)
+        dirty = mounteddisk->fatDirty[i];
+
+    pthread_mutex_unlock(&mounteddisk->fatLock);
+
+    pthread_mutex_lock(&mounteddisk->dirtyLock);
+    dirty = dirty || mounteddisk->numDirty > 0;
+    pthread_mutex_unlock(&mounteddisk->dirtyLock);
+
+    return dirty;
+}
+
+//Commit the journal periodically, until told to stop
+static void *commitThread(void *arg)
+{
+    Journal *journal = arg;
+
+    pthread_mutex_lock(&journal->lock);
+
+    while(!journal->stop)
+    {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += journal->interval / 1000;
+        deadline.tv_nsec += (long) (journal->interval % 1000) * 1000000;
+
+        if(deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline);
+
+        if(journal->stop)
+            break;
+
+        pthread_mutex_unlock(&journal->lock);
+
+        if(metadataDirty())
+            syncJournal();
+
+        pthread_mutex_lock(&journal->lock);
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+
+    return NULL;
+}
+
+//Number of blocks of the journal of a disk: every slot holds a header, the
+//metadata blocks and some blocks of subdirectories. Fails if the FAT is too
+//large to be journaled
+static int journalLength(Geometry *geo)
+{
+    if(metadataBlocks(geo) > (int) COMMIT_MAX_BLOCKS)
+        return FAILURE;
+
+    return JOURNAL_SLOTS * (metadataBlocks(geo) + 1 + journalDirBlocks(geo));
+}
+
+//Reserve room for a journal on a disk that has none, and record it in the
+//superblock. The new journal is on disk before anything is committed to it
+static int createJournal()
+{
+    Geometry *geo = &mounteddisk->geo;
+    int blocks = journalLength(geo);
+    int length;
+
+    if(blocks == FAILURE)
+        return FAILURE;
+
+    int start = allocRun(blocks, FAILURE, &length);
+
+    if(start == FAILURE)
+        return FAILURE;
+
+    //The slots have to be contiguous
+    if(length < blocks)
+    {
+        for(int i = start; i < start + length; i++)
+            freeBlock(i);
+
+        return FAILURE;
+    }
+
+    geo->journal = 1;
+    geo->journalStart = start;
+    geo->journalBlocks = blocks;
+    writeGeometry(mounteddisk->superblock, geo);
+
+    if(cache_write(SUPERBLOCK_INDEX, mounteddisk->superblock) != SUCCESS || writeBlocks() != SUCCESS
+       || cache_flush() != SUCCESS || block_disk_sync() != SUCCESS)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Start journaling the metadata of the mounted disk, committing every interval
+//milliseconds (never if 0)
+static int openJournal(int interval)
+{
+    int start, slotBlocks;
+
+    if(journalLayout(&mounteddisk->geo, &start, &slotBlocks) != SUCCESS)
+    {
+        if(createJournal() != SUCCESS
+           || journalLayout(&mounteddisk->geo, &start, &slotBlocks) != SUCCESS)
+            return FAILURE;
+    }
+
+    Journal *journal = calloc(1, sizeof(Journal));
+
+    if(journal == NULL)
+        return FAILURE;
+
+    journal->start = start;
+    journal->slotBlocks = slotBlocks;
+    journal->sequence = 1;
+    journal->interval = interval;
+    journal->slot = malloc((size_t) slotBlocks * BLOCK_SIZE);
+
+    journal->dirRoom = journalDirBlocks(&mounteddisk->geo);
+    journal->dirBlocks = malloc((journal->dirRoom + 1) * sizeof(Dirblock *));
+    journal->dirVersions = malloc((journal->dirRoom + 1) * sizeof(uint32_t));
+
+    if(journal->slot == NULL || journal->dirBlocks == NULL || journal->dirVersions == NULL)
+    {
+        free(journal->slot);
+        free(journal->dirBlocks);
+        free(journal->dirVersions);
+        free(journal);
+        return FAILURE;
+    }
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->done, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+
+    if(interval > 0 && pthread_create(&journal->thread, NULL, commitThread, journal) != 0)
+        journal->interval = 0;
+
+    mounteddisk->journal = journal;
+
+    return SUCCESS;
+}
+
+//Stop the commit thread and release the journal
+static void closeJournal()
+{
+    Journal *journal = mounteddisk->journal;
+
+    if(journal == NULL)
+        return;
+
+    if(journal->interval > 0)
+    {
+        pthread_mutex_lock(&journal->lock);
+        journal->stop = 1;
+        pthread_cond_signal(&journal->wake);
+        pthread_mutex_unlock(&journal->lock);
+
+        pthread_join(journal->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->done);
+    pthread_cond_destroy(&journal->wake);
+    free(journal->slot);
+    free(journal->dirBlocks);
+    free(journal->dirVersions);
+    free(journal);
+    mounteddisk->journal = NULL;
+}
+
+//Copy the FAT of the mounted disk
+static void copyFAT()
+{
+    for(int i = FIRST_FAT_BLOCK_INDEX; i < mounteddisk->geo.numFATBlocks + FIRST_FAT_BLOCK_INDEX; i++){
+        cache_read(i, fatBlock(i - FIRST_FAT_BLOCK_INDEX));
+    }
+
+}
+
+//Check to ensure the mounted disk has the correct block count
+static int checkBlockCount()
+{
+    if(mounteddisk->geo.numBlocks != block_disk_count())
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+//Check that the extents of every file stay within the data blocks and cover
+//the file without gaps
+static int checkExtents()
+{
+    for(int i = 0; mounteddisk->extents != NULL && i < ROOT_ENTRIES; i++)
+    {
+        Extentlist *list = &mounteddisk->extents[i];
+        uint32_t logical = 0;
+
+        if(list->numExtents > EXTENTS_PER_FILE)
+            return FAILURE;
+
+        for(uint32_t j = 0; j < list->numExtents; j++)
+        {
+            const Extent *extent = &list->extents[j];
+
+            if(extent->logical != logical || extent->length == 0
+               || (uint64_t) extent->start + extent->length > (uint64_t) mounteddisk->geo.numDataBlocks)
+                return FAILURE;
+
+            logical += extent->length;
+        }
+    }
+
+    return SUCCESS;
+}
+
+//Make sure disk has a valid format. Its signature and layout were checked
+//when loading the superblock
+static int validFormat()
+{
+    //Check the block count
+    if(checkBlockCount() != SUCCESS)
+        return FAILURE;
+
+    //Check the extent table
+    if(checkExtents() != SUCCESS)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+
+//Get the number of free data blocks
+static int numFreeDataBlocks()
+{
+    return mounteddisk->freeBlocks;
+}
+
+//Point the metadata straight at the mapped disk image instead of copying it
+static int mapDisk()
+{
+    //Nothing is to be freed, even if the disk turns out not to be valid
+    mounteddisk->mapped = 1;
+    mounteddisk->superblock = block_map(SUPERBLOCK_INDEX);
+
+    if(readGeometry(mounteddisk->superblock, &mounteddisk->geo) != SUCCESS)
+        return FAILURE;
+
+    //The FAT blocks directly follow the superblock, so they are contiguous in the mapping
+    mounteddisk->fat = block_map(FIRST_FAT_BLOCK_INDEX);
+    mounteddisk->root = block_map(mounteddisk->geo.rootindex);
+
+    //Make sure the superblock does not point outside of the disk
+    if(mounteddisk->fat == NULL || mounteddisk->root == NULL)
+        return FAILURE;
+
+    if(block_map(mounteddisk->geo.numFATBlocks) == NULL)
+        return FAILURE;
+
+    //The extent table is contiguous as well
+    if(mounteddisk->geo.extents)
+    {
+        mounteddisk->extents = block_map(mounteddisk->geo.extentindex);
+
+        if(mounteddisk->extents == NULL || block_map(mounteddisk->geo.extentindex + ROOT_ENTRIES - 1) == NULL)
+            return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+//Create a new disk
+static int createNewDisk(const char *diskname, int map)
+{
+    int namelength = strlen(diskname) + 1;
+
+    mounteddisk = malloc(sizeof(disk));
+    
+    mounteddisk->diskname = malloc(namelength * sizeof(char));
+    strcpy(mounteddisk->diskname, diskname);
+    mounteddisk->mapped = 0;
+    mounteddisk->superblock = NULL;
+    mounteddisk->fat = NULL;
+    mounteddisk->root = NULL;
+    mounteddisk->extents = NULL;
+    mounteddisk->fatDirty = NULL;
+    mounteddisk->rootDirty = 0;
+    mounteddisk->extentsDirty = NULL;
+    mounteddisk->journal = NULL;
+    mounteddisk->freemap = NULL;
+    memset(&mounteddisk->rootdir, 0, sizeof(Directory));
+    mounteddisk->lastDir = &mounteddisk->rootdir;
+    mounteddisk->dirtyBlocks = NULL;
+    mounteddisk->numDirty = 0;
+    mounteddisk->dirtyRoom = 0;
+    mounteddisk->numDirBlocks = 0;
+    mounteddisk->reservedBlocks = 0;
+    mounteddisk->deadBlocks = NULL;
+
+    //Recover from a crash before loading the metadata
+    if(replayJournal() != SUCCESS)
+        return FAILURE;
+
+    //A memory-mapped disk needs no copy of its metadata
+    if(map && block_map(SUPERBLOCK_INDEX) != NULL)
+        return mapDisk();
+
+    //Allocate blocks
+    mounteddisk->superblock = malloc(BLOCK_SIZE);
+
+    if(mounteddisk->superblock == NULL)
+        return FAILURE;
+    
+    //Copy superblock, and find out which version of the format the disk uses
+    if(cache_read(SUPERBLOCK_INDEX, mounteddisk->superblock) != SUCCESS
+       || readGeometry(mounteddisk->superblock, &mounteddisk->geo) != SUCCESS)
+        return FAILURE;
+    
+    //A FAT block holds 2048 16-bit entries, 1024 32-bit ones, or the bits of 32768 blocks
+    mounteddisk->fat = malloc((size_t) mounteddisk->geo.numFATBlocks * BLOCK_SIZE);
+    mounteddisk->root = malloc(BLOCK_SIZE);
+
+    if(mounteddisk->fat == NULL || mounteddisk->root == NULL)
+        return FAILURE;
+    
+    //Copy the FAT
+    copyFAT();
+
+    //Copy root directory
+    cache_read(mounteddisk->geo.rootindex, mounteddisk->root);
+
+    //Nothing needs to be written back yet
+    mounteddisk->fatDirty = calloc(mounteddisk->geo.numFATBlocks, sizeof(uint8_t));
+
+    if(mounteddisk->fatDirty == NULL)
+        return FAILURE;
+
+    //Copy the extent table, the blocks of unused entries are just zeroes
+    if(mounteddisk->geo.extents)
+    {
+        mounteddisk->extents = malloc(ROOT_ENTRIES * sizeof(Extentlist));
+        mounteddisk->extentsDirty = calloc(ROOT_ENTRIES, sizeof(uint8_t));
+
+        if(mounteddisk->extents == NULL || mounteddisk->extentsDirty == NULL
+           || cache_read_range(mounteddisk->geo.extentindex, ROOT_ENTRIES, mounteddisk->extents) != SUCCESS)
+            return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+//Release every block of a chain
+static void clearFATChain(int start_index)
+{
+    int index = start_index;
+    int steps = 0;
+
+    while(index != FAT_EOC){
+        int next = nextBlock(index);
+        freeBlock(index);
+        index = next;
+        steps++;
+    }
+
+    addStat(&stats.chain_steps, steps);
+}
+
+//Release every block of a file stored as extents
+static void clearExtents(Rootentry *file)
+{
+    Extentlist *list = fileExtents(file);
+
+    for(uint32_t i = 0; i < list->numExtents; i++)
+    {
+        for(uint32_t j = 0; j < list->extents[i].length; j++)
+            freeBlock(list->extents[i].start + j);
+    }
+
+    list->numExtents = 0;
+    markExtentsDirty(file);
+}
+
+static void clearRootEntry(Rootentry* root_file)
+{
+    //Save file info to that root entry
+    root_file->filename[0] = '\0';
+    setFileSize(root_file, 0);
+    setFirstBlock(root_file, 0);
+    setEntryType(root_file, ENTRY_FILE);
+    markEntryDirty(root_file);
+}
+
+//Count one more block of a subdirectory, making room for it in the list of
+//modified blocks
+static int addDirBlock()
+{
+    int ret = SUCCESS;
+
+    pthread_mutex_lock(&mounteddisk->dirtyLock);
+
+    if(mounteddisk->numDirBlocks == mounteddisk->dirtyRoom)
+    {
+        int room = mounteddisk->dirtyRoom > 0 ? 2 * mounteddisk->dirtyRoom : DIR_BLOCK_ENTRIES;
+        Dirblock **blocks = realloc(mounteddisk->dirtyBlocks, room * sizeof(Dirblock *));
+
+        if(blocks == NULL)
+            ret = FAILURE;
+        else
+        {
+            mounteddisk->dirtyBlocks = blocks;
+            mounteddisk->dirtyRoom = room;
+        }
+    }
+
+    if(ret == SUCCESS)
+        mounteddisk->numDirBlocks++;
+
+    pthread_mutex_unlock(&mounteddisk->dirtyLock);
+
+    return ret;
+}
+
+//Get a new block of a subdirectory in memory, aligned so that the block
+//holding an entry is found from the entry's address
+static Dirblock *newDirBlock()
+{
+    Dirblock *block = aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+
+    if(block != NULL && addDirBlock() != SUCCESS)
+    {
+        free(block);
+        return NULL;
+    }
+
+    return block;
+}
+
+//Set the bookkeeping of block number index of a subdirectory, held by data
+//block block
+static void setDirHeader(Dirblock *dirblock, Directory *dir, int index, uint32_t block)
+{
+    memset(&dirblock->header, 0, sizeof(Rootentry));
+    dirblock->header.dir = dir;
+    dirblock->header.index = index;
+    dirblock->header.block = block;
+}
+
+//Add a directory to the list of directories
+static void linkDirectory(Directory *dir)
+{
+    dir->prev = mounteddisk->lastDir;
+    dir->next = NULL;
+    mounteddisk->lastDir->next = dir;
+    mounteddisk->lastDir = dir;
+}
+
+//Free a subdirectory that is not in the list of directories, but not its blocks
+static void freeDirectory(Directory *dir)
+{
+    free(dir->blocks);
+    free(dir->subdirs);
+    free(dir->open);
+    indexFree(&dir->index);
+    free(dir);
+}
+
+//Get a new empty subdirectory
+static Directory *newDirectory()
+{
+    Directory *dir = calloc(1, sizeof(Directory));
+
+    if(dir == NULL)
+        return NULL;
+
+    if(indexBuild(dir, 0) != SUCCESS)
+    {
+        freeDirectory(dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+//Load the subdirectory held by an entry, which fails if its blocks are not
+//there or if it has more than maxBlocks of them
+static Directory *loadDirectory(Rootentry *entry, int maxBlocks)
+{
+    size_t size = fileSize(entry);
+    Directory *dir = calloc(1, sizeof(Directory));
+
+    if(dir == NULL)
+        return NULL;
+
+    dir->entry = entry;
+
+    int numBlocks = size / BLOCK_SIZE;
+
+    dir->blocks = malloc((numBlocks + 1) * sizeof(Dirblock *));
+    dir->subdirs = calloc((size_t) numBlocks * DIR_BLOCK_ENTRIES + 1, sizeof(Directory *));
+    dir->open = calloc((size_t) numBlocks * DIR_BLOCK_ENTRIES + 1, sizeof(Openfile *));
+
+    if(size % BLOCK_SIZE != 0 || size / BLOCK_SIZE > (size_t) maxBlocks
+       || dir->blocks == NULL || dir->subdirs == NULL || dir->open == NULL)
+    {
+        freeDirectory(dir);
+        return NULL;
+    }
+
+    //Walk the directory like a file
+    Fileinfo view = {0};
+    uint32_t blocks[BATCH_BLOCKS];
+    int ret = SUCCESS;
+
+    view.root = entry;
+    view.block = firstBlock(entry);
+    view.block_index = view.block == FAT_EOC ? -1 : 0;
+
+    for(int i = 0; i < numBlocks && ret == SUCCESS; i += BATCH_BLOCKS)
+    {
+        int n = numBlocks - i < BATCH_BLOCKS ? numBlocks - i : BATCH_BLOCKS;
+
+        if(collectBlocks(&view, i, n, 0, blocks) != n)
+            ret = FAILURE;
+
+        for(int j = 0; j < n && ret == SUCCESS; j++)
+        {
+            Dirblock *block = newDirBlock();
+
+            if(block == NULL || cache_read(blocks[j] + mounteddisk->geo.datastartindex, block) != SUCCESS)
+            {
+                free(block);
+                ret = FAILURE;
+                break;
+            }
+
+            setDirHeader(block, dir, i + j, blocks[j]);
+            dir->blocks[dir->numBlocks++] = block;
+        }
+    }
+
+    if(ret == SUCCESS)
+        ret = indexBuild(dir, numBlocks * DIR_BLOCK_ENTRIES);
+
+    if(ret != SUCCESS)
+    {
+        for(int i = 0; i < dir->numBlocks; i++)
+            free(dir->blocks[i]);
+
+        freeDirectory(dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+//Set up the root directory, and load every subdirectory down from it. A
+//corrupted disk could have a directory hold one of its parents: no more blocks
+//are loaded than there are data blocks
+static int loadDirectories()
+{
+    Directory *root = &mounteddisk->rootdir;
+
+    root->subdirs = calloc(ROOT_ENTRIES, sizeof(Directory *));
+    root->open = calloc(ROOT_ENTRIES, sizeof(Openfile *));
+
+    if(root->subdirs == NULL || root->open == NULL || indexBuild(root, ROOT_ENTRIES) != SUCCESS)
+        return FAILURE;
+
+    //The list of directories doubles as the queue of the directories to walk
+    for(Directory *dir = root; dir != NULL; dir = dir->next)
+    {
+        for(int i = 0; i < dir->index.numEntries; i++)
+        {
+            Rootentry *entry = dirEntry(dir, i);
+
+            if(!usableEntry(dir, i) || rootEntryFree(*entry) == SUCCESS || entryType(entry) != ENTRY_DIRECTORY)
+                continue;
+
+            //The extent table only has lists for the entries of the root directory
+            if(mounteddisk->geo.extents)
+                return FAILURE;
+
+            Directory *subdir = loadDirectory(entry, mounteddisk->geo.numDataBlocks - mounteddisk->numDirBlocks);
+
+            if(subdir == NULL)
+                return FAILURE;
+
+            dir->subdirs[i] = subdir;
+            linkDirectory(subdir);
+        }
+    }
+
+    return SUCCESS;
+}
+
+//Add a block of free entries to a subdirectory
+static int growDirectory(Directory *dir)
+{
+    int numBlocks = dir->numBlocks + 1;
+    Dirblock **blocks = realloc(dir->blocks, numBlocks * sizeof(Dirblock *));
+
+    if(blocks == NULL)
+        return FAILURE;
+
+    dir->blocks = blocks;
+
+    Directory **subdirs = realloc(dir->subdirs, (size_t) numBlocks * DIR_BLOCK_ENTRIES * sizeof(Directory *));
+
+    if(subdirs == NULL)
+        return FAILURE;
+
+    dir->subdirs = subdirs;
+    memset(&subdirs[dir->numBlocks * DIR_BLOCK_ENTRIES], 0, DIR_BLOCK_ENTRIES * sizeof(Directory *));
+
+    Openfile **open = realloc(dir->open, (size_t) numBlocks * DIR_BLOCK_ENTRIES * sizeof(Openfile *));
+
+    if(open == NULL)
+        return FAILURE;
+
+    dir->open = open;
+    memset(&open[dir->numBlocks * DIR_BLOCK_ENTRIES], 0, DIR_BLOCK_ENTRIES * sizeof(Openfile *));
+
+    Dirblock *block = newDirBlock();
+
+    if(block == NULL)
+        return FAILURE;
+
+    //Allocate the new block like a file's, continuing from the last one
+    Fileinfo view = {0};
+    uint32_t dataBlock;
+
+    view.root = dir->entry;
+    view.block = dir->numBlocks > 0 ? (int32_t) dir->blocks[dir->numBlocks - 1]->header.block : FAT_EOC;
+    view.block_index = dir->numBlocks - 1;
+
+    if(collectBlocks(&view, dir->numBlocks, 1, 1, &dataBlock) != 1)
+    {
+        pthread_mutex_lock(&mounteddisk->dirtyLock);
+        mounteddisk->numDirBlocks--;
+        pthread_mutex_unlock(&mounteddisk->dirtyLock);
+        free(block);
+        return FAILURE;
+    }
+
+    memset(block, 0, BLOCK_SIZE);
+    setDirHeader(block, dir, dir->numBlocks, dataBlock);
+    dir->blocks[dir->numBlocks++] = block;
+    markEntryDirty(&block->entries[1]);
+
+    setFileSize(dir->entry, (size_t) dir->numBlocks * BLOCK_SIZE);
+    markEntryDirty(dir->entry);
+
+    return indexGrow(dir, dir->numBlocks * DIR_BLOCK_ENTRIES);
+}
+
+//Release a deleted subdirectory, which must be empty. Its blocks are only freed
+//once no commit can be writing them
+static void dropDirectory(Directory *dir)
+{
+    pthread_mutex_lock(&mounteddisk->dirtyLock);
+
+    for(int i = 0; i < dir->numBlocks; i++)
+    {
+        dir->blocks[i]->header.dead = 1;
+        dir->blocks[i]->header.nextDead = mounteddisk->deadBlocks;
+        mounteddisk->deadBlocks = dir->blocks[i];
+    }
+
+    pthread_mutex_unlock(&mounteddisk->dirtyLock);
+
+    dir->prev->next = dir->next;
+
+    if(dir->next != NULL)
+        dir->next->prev = dir->prev;
+    else
+        mounteddisk->lastDir = dir->prev;
+
+    freeDirectory(dir);
+}
+
+//Free every directory and every block of a subdirectory
+static void freeDirectories()
+{
+    Directory *dir = mounteddisk->rootdir.next;
+
+    while(dir != NULL)
+    {
+        Directory *next = dir->next;
+
+        for(int i = 0; i < dir->numBlocks; i++)
+            free(dir->blocks[i]);
+
+        freeDirectory(dir);
+        dir = next;
+    }
+
+    while(mounteddisk->deadBlocks != NULL)
+    {
+        Dirblock *block = mounteddisk->deadBlocks;
+
+        mounteddisk->deadBlocks = block->header.nextDead;
+        free(block);
+    }
+
+    free(mounteddisk->rootdir.subdirs);
+    free(mounteddisk->rootdir.open);
+    indexFree(&mounteddisk->rootdir.index);
+    free(mounteddisk->dirtyBlocks);
+}
+
+//Free mounted disk
+static void freeDisk()
+{
+    free(mounteddisk->diskname);
+    free(mounteddisk->freemap);
+    free(mounteddisk->fatDirty);
+    free(mounteddisk->extentsDirty);
+    closeJournal();
+    freeDirectories();
+
+    if(!mounteddisk->mapped)
+    {
+        free(mounteddisk->superblock);
+        free(mounteddisk->fat);
+        free(mounteddisk->root);
+        free(mounteddisk->extents);
+    }
+
+    free(mounteddisk);
+    mounteddisk = NULL;
+}
+
+//set up file list, empty until files are opened, for up to openMax of them
+static void setUpFileList(int openMax)
+{
+    for(int i = 0; i < FD_CHUNKS; i++)
+        openfiles[i] = NULL;
+
+    numFds = 0;
+    maxFds = openMax;
+    freeFds = NO_FD;
+    numOpen = 0;
+}
+
+//Add the next chunk of free descriptors to the file table, without going past
+//maxFds. Called with fdTableLock held
+static int growFileList()
+{
+    int chunk = 31 - __builtin_clz(numFds / FD_CHUNK + 1);
+    int size = FD_CHUNK << chunk;
+
+    if(size > maxFds - numFds)
+        size = maxFds - numFds;
+
+    if(size <= 0)
+        return FAILURE;
+
+    Fileinfo *infos = malloc(size * sizeof(Fileinfo));
+
+    if(infos == NULL)
+        return FAILURE;
+
+    for(int i = 0; i < size; i++){
+        infos[i].open = 0;
+        infos[i].nextFree = i + 1 < size ? numFds + i + 1 : NO_FD;
+        infos[i].map = NULL;
+        infos[i].bounce = NULL;
+        infos[i].wbuf = NULL;
+        pthread_mutex_init(&infos[i].lock, NULL);
+    }
+
+    openfiles[chunk] = infos;
+    freeFds = numFds;
+
+    //Publish the chunk to the threads looking descriptors up
+    __atomic_store_n(&numFds, numFds + size, __ATOMIC_RELEASE);
+
+    return SUCCESS;
+}
+
+//Take a free descriptor off the file table, NO_FD if it is full. Called with
+//fdTableLock held
+static int allocFd()
+{
+    if(freeFds == NO_FD && growFileList() != SUCCESS)
+        return NO_FD;
+
+    int fd = freeFds;
+
+    freeFds = fdInfo(fd)->nextFree;
+    numOpen++;
+
+    return fd;
+}
+
+//Put a closed descriptor back in the file table. Called with fdTableLock held
+static void releaseFd(int fd)
+{
+    fdInfo(fd)->nextFree = freeFds;
+    freeFds = fd;
+    numOpen--;
+}
+
+//Release the file table
+static void freeFileList()
+{
+    for(int i = 0; i < FD_CHUNKS && openfiles[i] != NULL; i++)
+    {
+        int first = FD_CHUNK * ((1 << i) - 1);
+        int size = FD_CHUNK << i;
+
+        if(size > numFds - first)
+            size = numFds - first;
+
+        for(int j = 0; j < size; j++)
+            pthread_mutex_destroy(&openfiles[i][j].lock);
+
+        free(openfiles[i]);
+        openfiles[i] = NULL;
+    }
+
+    numFds = 0;
+    freeFds = NO_FD;
+}
+
+//set up the locks of the mounted disk
+static void setUpLocks()
+{
+    pthread_rwlock_init(&mounteddisk->dirLock, NULL);
+    pthread_mutex_init(&mounteddisk->fatLock, NULL);
+    pthread_mutex_init(&mounteddisk->dirtyLock, NULL);
+
+    for(int i = 0; i < FILE_LOCKS; i++)
+        pthread_rwlock_init(&mounteddisk->fileLocks[i], NULL);
+}
+
+//release the locks of the mounted disk and of the file list
+static void destroyLocks()
+{
+    pthread_rwlock_destroy(&mounteddisk->dirLock);
+    pthread_mutex_destroy(&mounteddisk->fatLock);
+    pthread_mutex_destroy(&mounteddisk->dirtyLock);
+
+    for(int i = 0; i < FILE_LOCKS; i++)
+        pthread_rwlock_destroy(&mounteddisk->fileLocks[i]);
+
+    freeFileList();
+}
+
+//Write the changes to disk
+static int syncDisk()
+{
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    //Journaled metadata goes through the journal
+    if(mounteddisk->journal != NULL)
+        return syncJournal();
+
+    //Write the modified metadata, then every dirty block, out to disk
+    lockMetadata();
+    int ret = writeBlocks();
+    unlockMetadata();
+
+    if(ret != SUCCESS)
+        return FAILURE;
+
+    return cache_flush();
+}
+
+//Reserve room in the next commit for n blocks of subdirectories about to be
+//modified. Fails if the journal has to be committed first
+static int tryReserveDirBlocks(int n)
+{
+    Journal *journal = mounteddisk->journal;
+    int ret = SUCCESS;
+
+    if(journal == NULL || n == 0)
+        return SUCCESS;
+
+    pthread_mutex_lock(&mounteddisk->dirtyLock);
+
+    if(mounteddisk->numDirty + mounteddisk->reservedBlocks + n > journal->dirRoom)
+        ret = FAILURE;
+    else
+        mounteddisk->reservedBlocks += n;
+
+    pthread_mutex_unlock(&mounteddisk->dirtyLock);
+
+    return ret;
+}
+
+//Commit the journal to make room for n blocks of subdirectories. Called
+//without any lock held. Fails if a commit can never hold them
+static int makeDirRoom(int n)
+{
+    if(n > mounteddisk->journal->dirRoom)
+        return FAILURE;
+
+    return syncJournal();
+}
+
+//Reserve room in the next commit for n blocks of subdirectories, committing the
+//journal while there is none. Called without any lock held
+static int reserveDirBlocks(int n)
+{
+    while(tryReserveDirBlocks(n) != SUCCESS)
+    {
+        if(makeDirRoom(n) != SUCCESS)
+            return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+//Release room reserved by reserveDirBlocks(), once the blocks are modified
+static void releaseDirBlocks(int n)
+{
+    if(mounteddisk->journal == NULL || n == 0)
+        return;
+
+    pthread_mutex_lock(&mounteddisk->dirtyLock);
+    mounteddisk->reservedBlocks -= n;
+    pthread_mutex_unlock(&mounteddisk->dirtyLock);
+}
+
+//Number of blocks of subdirectories to reserve to change a file's entry
+static int entryReserve(const Rootentry *file)
+{
+    return mounteddisk->journal != NULL && !inRootDirectory(file);
+}
+
+//Number of blocks of subdirectories to reserve for a directory operation on a
+//path: the entry's block, a new block of its directory, and the block of the
+//entry of that directory
+static int pathReserve(const char *path)
+{
+    if(isString(path) != SUCCESS || !inSubdirectory(path))
+        return 0;
+
+    return DIR_OP_BLOCKS;
+}
+
+int fs_format(const char *diskname, size_t nblocks, const struct fs_format_options *opts)
+{
+    int version = opts != NULL ? opts->version : 0;
+    int extents = opts != NULL && opts->extents;
+
+    //Use the version 1 format whenever it can hold the disk (and has no
+    //extents, which only version 2 has)
+    if(version == 0)
+        version = nblocks > FS_DATA_BLOCKS_MAX || extents ? 2 : 1;
+
+    //The disk layer can only open one disk at a time
+    if(mounteddisk != NULL || nblocks == 0 || (version != 1 && version != 2) || (extents && version != 2)
+       || nblocks > (version == 1 ? FS_DATA_BLOCKS_MAX : FS2_DATA_BLOCKS_MAX))
+        return FAILURE;
+
+    //The superblock, the FAT, the root directory and the extent table directly
+    //follow each other
+    Geometry geo = {0};
+
+    geo.version = version;
+    geo.extents = extents;
+    geo.fatBits = version == 1 ? 16 : extents ? 1 : 32;
+    geo.numFATBlocks = (nblocks * geo.fatBits + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+    geo.rootindex = FIRST_FAT_BLOCK_INDEX + geo.numFATBlocks;
+    geo.extentindex = extents ? geo.rootindex + 1 : 0;
+    geo.datastartindex = geo.rootindex + 1 + (extents ? ROOT_ENTRIES : 0);
+    geo.numDataBlocks = nblocks;
+    geo.numBlocks = geo.datastartindex + nblocks;
+
+    //The journal takes the data blocks following the first one
+    int length = 0;
+
+    if(opts != NULL && opts->journal)
+    {
+        length = journalLength(&geo);
+
+        if(length == FAILURE || length >= (int) nblocks)
+            return FAILURE;
+
+        geo.journal = 1;
+        geo.journalStart = 1;
+        geo.journalBlocks = length;
+    }
+
+    //Only the superblock and the start of the FAT are not zeroes
+    int headBlocks = FIRST_FAT_BLOCK_INDEX + ((length + 1) * geo.fatBits + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+    uint8_t *head = calloc(headBlocks, BLOCK_SIZE);
+
+    if(head == NULL)
+        return FAILURE;
+
+    FAT fat = &head[FIRST_FAT_BLOCK_INDEX * BLOCK_SIZE];
+
+    writeGeometry(head, &geo);
+
+    //The first data block is never used
+    storeFAT(fat, geo.fatBits, 0, FAT_EOC);
+
+    for(int i = 1; i <= length; i++)
+        storeFAT(fat, geo.fatBits, i, i < length ? i + 1 : FAT_EOC);
+
+    //Write it at once, the rest of the metadata and the data blocks are left as
+    //a hole
+    int ret = block_disk_create(diskname, geo.numBlocks, opts != NULL && opts->preallocate);
+
+    if(ret == SUCCESS)
+    {
+        ret = block_write_range(SUPERBLOCK_INDEX, headBlocks, head);
+
+        if(block_disk_close() != SUCCESS)
+            ret = FAILURE;
+    }
+
+    free(head);
+
+    return ret == SUCCESS ? SUCCESS : FAILURE;
+}
+
+int fs_mount(const char *diskname)
+{
+    return fs_mount_opts(diskname, NULL);
+}
+
+int fs_mount_opts(const char *diskname, const struct fs_mount_options *opts)
+{
+    int ret;
+    int cacheBlocks = FS_CACHE_BLOCKS;
+
+    if(opts != NULL && opts->cache_blocks != 0)
+        cacheBlocks = opts->cache_blocks;
+
+    //A memory-mapped disk is its own cache
+    if(opts != NULL && opts->mmap)
+        cacheBlocks = 0;
+
+    //Make sure no disk is mounted
+    if(mounteddisk != NULL)
+        return FAILURE;
+
+    memset(&stats, 0, sizeof(stats));
+
+    //Attempt to open disk.
+    if(opts != NULL && opts->mmap)
+        ret = block_disk_open_mmap(diskname);
+    else
+        ret = block_disk_open(diskname);
+
+    if(ret != SUCCESS)
+        return FAILURE;
+
+    //Set up the block cache
+    if(cache_init(cacheBlocks > 0 ? cacheBlocks : 0) != SUCCESS)
+    {
+        block_disk_close();
+        return FAILURE;
+    }
+
+    //Journaled metadata cannot be modified in place in a mapping, the system
+    //could write it back before it is committed
+    int journal = opts != NULL && opts->journal;
+
+    //Create new disk and check the format
+    if(createNewDisk(diskname, !journal) != SUCCESS || validFormat() != SUCCESS
+       || buildFreeMap() != SUCCESS)
+    {
+        freeDisk();
+        cache_destroy();
+        block_disk_close();
+        return FAILURE;
+    }
+
+    //Cap the number of open file descriptors
+    int openMax = FS_OPEN_MAX_COUNT;
+
+    if(opts != NULL && opts->open_max != 0)
+        openMax = opts->open_max > 0 && opts->open_max < FD_MAX ? opts->open_max : FD_MAX;
+
+    setUpFileList(openMax);
+    setUpLocks();
+
+    //Load the directories, which takes the locks of the list of modified blocks
+    if(loadDirectories() != SUCCESS)
+    {
+        destroyLocks();
+        freeDisk();
+        cache_destroy();
+        block_disk_close();
+        return FAILURE;
+    }
+
+    mounteddisk->blockMaps = opts != NULL && opts->block_maps;
+
+    for(int i = 0; i < FILE_LOCKS; i++)
+        mounteddisk->appendFd[i] = NO_FD;
+
+    //Read-ahead goes through the cache, and should not take most of it
+    mounteddisk->readahead = FS_READAHEAD_BLOCKS;
+
+    if(opts != NULL && opts->readahead != 0)
+        mounteddisk->readahead = opts->readahead > 0 ? opts->readahead : 0;
+
+    if(mounteddisk->readahead > cacheBlocks / 2)
+        mounteddisk->readahead = cacheBlocks > 0 ? cacheBlocks / 2 : 0;
+
+    if(mounteddisk->readahead > BATCH_BLOCKS)
+        mounteddisk->readahead = BATCH_BLOCKS;
+
+    //Start journaling last, the commit thread expects everything set up
+    if(journal)
+    {
+        int interval = FS_COMMIT_INTERVAL;
+
+        if(opts->commit_interval != 0)
+            interval = opts->commit_interval > 0 ? opts->commit_interval : 0;
+
+        if(openJournal(interval) != SUCCESS)
+        {
+            destroyLocks();
+            freeDisk();
+            cache_destroy();
+            block_disk_close();
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
+
+int fs_umount(void)
+{
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    //Make sure no asynchronous request is left
+    pthread_mutex_lock(&aioLock);
+    int aioLeft = aioWaiting > 0 || aioReady != NULL;
+    pthread_mutex_unlock(&aioLock);
+
+    if(aioLeft)
+        return FAILURE;
+
+    //Make sure no file is still open
+    pthread_mutex_lock(&fdTableLock);
+    int fdsLeft = numOpen > 0;
+    pthread_mutex_unlock(&fdTableLock);
+
+    if(fdsLeft)
+        return FAILURE;
+    
+    //Write blocks back out to disk
+    if(syncDisk() != SUCCESS)
+        return FAILURE;
+
+    //Everything is in place on disk, the journal can be emptied unless nothing
+    //was committed to it
+    if(mounteddisk->journal != NULL)
+    {
+        Journal *journal = mounteddisk->journal;
+
+        pthread_mutex_lock(&journal->lock);
+
+        while(journal->running)
+            pthread_cond_wait(&journal->done, &journal->lock);
+
+        int used = journal->sequence > 1;
+
+        pthread_mutex_unlock(&journal->lock);
+
+        if(used && emptyJournal(journal->start, journal->slotBlocks) != SUCCESS)
+            return FAILURE;
+
+        closeJournal();
+    }
+
+    //Close the disk
+    cache_destroy();
+    block_disk_close();
+
+    //Free the disk
+    destroyLocks();
+    freeDisk();
+
+    return SUCCESS;
+}
+
+int fs_sync(void)
+{
+    addStat(&stats.calls[FS_OP_SYNC], 1);
+
+    return syncDisk();
+}
+
+int fs_fsync(int fd)
+{
+    addStat(&stats.calls[FS_OP_FSYNC], 1);
+
+    if(lockFd(fd) != SUCCESS)
+        return FAILURE;
+
+    Rootentry *file = fdInfo(fd)->root;
+
+    pthread_rwlock_wrlock(fileLock(file));
+    int ret = flushAppends(file);
+    pthread_rwlock_unlock(fileLock(file));
+
+    pthread_mutex_unlock(&fdInfo(fd)->lock);
+
+    //The file's size is in the root directory
+    if(ret != SUCCESS || syncDisk() != SUCCESS)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+int fs_cache_stats(struct fs_cache_stats *stats)
+{
+    struct cache_stats counters;
+
+    if(mounteddisk == NULL || stats == NULL)
+        return FAILURE;
+
+    cache_get_stats(&counters);
+
+    stats->hits = counters.hits;
+    stats->misses = counters.misses;
+    stats->evictions = counters.evictions;
+    stats->writebacks = counters.writebacks;
+    stats->prefetched = counters.prefetched;
+
+    return SUCCESS;
+}
+
+int fs_stats(struct fs_stats *out)
+{
+    struct block_stats disk;
+    size_t *counters = (size_t *) &stats;
+    size_t *copy = (size_t *) out;
+
+    if(mounteddisk == NULL || out == NULL)
+        return FAILURE;
+
+    //Every field is a counter
+    for(size_t i = 0; i < sizeof(stats) / sizeof(size_t); i++)
+        copy[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+
+    //Calls with a latency histogram are counted there
+    for(int i = 0; i < FS_LATENCY_BUCKETS; i++)
+    {
+        out->calls[FS_OP_OPEN] += out->open_latency[i];
+        out->calls[FS_OP_WRITE] += out->write_latency[i];
+        out->calls[FS_OP_READ] += out->read_latency[i];
+    }
+
+    block_get_stats(&disk);
+
+    out->disk_reads = disk.reads;
+    out->disk_writes = disk.writes;
+    out->blocks_read = disk.blocks_read;
+    out->blocks_written = disk.blocks_written;
+
+    return SUCCESS;
+}
+
+int fs_info(void)
+{
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    pthread_rwlock_rdlock(&mounteddisk->dirLock);
+    pthread_mutex_lock(&mounteddisk->fatLock);
+
+    //Print info
+    printf("FS Info:\n");
+    printf("total_blk_count=%d\n", mounteddisk->geo.numBlocks);
+    printf("fat_blk_count=%d\n", mounteddisk->geo.numFATBlocks);
+    printf("rdir_blk=%d\n", mounteddisk->geo.rootindex);
+    printf("data_blk=%d\n", mounteddisk->geo.datastartindex);
+    printf("data_blk_count=%d\n", mounteddisk->geo.numDataBlocks);
+    printf("fat_free_ratio=%d/%d\n", numFreeDataBlocks(), mounteddisk->geo.numDataBlocks);
+    printf("rdir_free_ratio=%d/%d\n", numEmptyEntriesRootDir(), ROOT_ENTRIES);
+
+    pthread_mutex_unlock(&mounteddisk->fatLock);
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
     
-    //Check the signature
-    if(strcmp(signature, FS_SIGNATURE) != 0)
+    return SUCCESS;
+}
+
+//Create an empty file or directory
+static int createEntry(const char *path, int type)
+{
+    char filename[FS_FILENAME_LEN];
+    int reserved = pathReserve(path);
+
+    //Make sure disk is mounted
+    if(mounteddisk == NULL || reserveDirBlocks(reserved) != SUCCESS)
+        return FAILURE;
+
+    pthread_rwlock_wrlock(&mounteddisk->dirLock);
+
+    //Check for errors
+    Directory *dir = resolvePath(path, filename);
+    Directory *subdir = NULL;
+    int ret = create_err_check(dir, filename);
+
+    //The extent table has no lists for the entries of subdirectories
+    if(ret == SUCCESS && type == ENTRY_DIRECTORY && mounteddisk->geo.extents)
+        ret = FAILURE;
+
+    if(ret == SUCCESS && type == ENTRY_DIRECTORY && (subdir = newDirectory()) == NULL)
+        ret = FAILURE;
+
+    //Find next open entry, a full subdirectory gets a new block
+    int entry = ret == SUCCESS ? findNextEmpty(dir) : NO_ENTRY;
+
+    if(ret == SUCCESS && entry == NO_ENTRY
+       && (growDirectory(dir) != SUCCESS || (entry = findNextEmpty(dir)) == NO_ENTRY))
+        ret = FAILURE;
+
+    if(ret != SUCCESS)
+    {
+        if(subdir != NULL)
+            freeDirectory(subdir);
+
+        pthread_rwlock_unlock(&mounteddisk->dirLock);
+        releaseDirBlocks(reserved);
         return FAILURE;
+    }
+
+    //Save file info to that entry
+    Rootentry *open = dirEntry(dir, entry);
+
+    strcpy((char *) open->filename, filename);
+    setFileSize(open, 0);
+    setFirstBlock(open, FAT_EOC);
+    setEntryType(open, type);
+    markEntryDirty(open);
+
+    indexInsert(dir, entry);
+
+    if(subdir != NULL)
+    {
+        subdir->entry = open;
+        dir->subdirs[entry] = subdir;
+        linkDirectory(subdir);
+    }
+
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
+    releaseDirBlocks(reserved);
 
     return SUCCESS;
 }
 
-//Check to ensure the mounted disk has the correct block count
-static int checkBlockCount()
+int fs_create(const char *filename)
+{
+    addStat(&stats.calls[FS_OP_CREATE], 1);
+
+    return createEntry(filename, ENTRY_FILE);
+}
+
+int fs_mkdir(const char *dirname)
+{
+    addStat(&stats.calls[FS_OP_MKDIR], 1);
+
+    return createEntry(dirname, ENTRY_DIRECTORY);
+}
+
+int fs_delete(const char *filename)
+{
+    char name[FS_FILENAME_LEN];
+
+    addStat(&stats.calls[FS_OP_DELETE], 1);
+
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    int reserved = pathReserve(filename);
+
+    if(reserveDirBlocks(reserved) != SUCCESS)
+        return FAILURE;
+
+    //Nobody can open the file while the directory is locked
+    pthread_rwlock_wrlock(&mounteddisk->dirLock);
+    pthread_mutex_lock(&fdTableLock);
+
+    //Check for errors
+    Directory *dir = resolvePath(filename, name);
+    int ret = delete_err_check(dir, name);
+
+    pthread_mutex_unlock(&fdTableLock);
+
+    if(ret != SUCCESS)
+    {
+        pthread_rwlock_unlock(&mounteddisk->dirLock);
+        releaseDirBlocks(reserved);
+        return FAILURE;
+    }
+
+    //return index of failure
+    int entry = findFile(dir, name);
+    Rootentry* root_file = dirEntry(dir, entry);
+
+    pthread_mutex_lock(&mounteddisk->fatLock);
+
+    if(mounteddisk->geo.extents)
+        clearExtents(root_file);
+    else
+        clearFATChain(firstBlock(root_file));
+
+    pthread_mutex_unlock(&mounteddisk->fatLock);
+
+    //An empty directory goes with its blocks
+    if(dir->subdirs[entry] != NULL)
+    {
+        dropDirectory(dir->subdirs[entry]);
+        dir->subdirs[entry] = NULL;
+    }
+
+    indexRemove(dir, entry);
+
+    clearRootEntry(root_file);
+
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
+    releaseDirBlocks(reserved);
+
+    return SUCCESS;
+}
+
+//Print the entries of a directory, with the directory locked
+static void listDirectory(Directory *dir)
+{
+    printf("FS Ls:\n");
+
+    for(int i = 0; i < dir->index.numEntries; i++)
+    {
+        Rootentry *file = dirEntry(dir, i);
+
+        if(usableEntry(dir, i) && rootEntryFree(*file) != SUCCESS)
+        {
+            pthread_rwlock_rdlock(fileLock(file));
+            printf("%s: %s,", dir->subdirs[i] != NULL ? "dir" : "file", file->filename);
+            int first = firstBlock(file);
+
+            //An empty file shows the end-of-chain marker of the disk's FAT
+            printf(" size: %zu,", fileSize(file));
+            printf(" data_blk: %u\n", first != FAT_EOC ? (unsigned int) first
+                   : mounteddisk->geo.version == 2 ? FAT32_EOC : FAT16_EOC);
+            pthread_rwlock_unlock(fileLock(file));
+        }
+    }
+}
+
+int fs_ls(void)
+{
+    addStat(&stats.calls[FS_OP_LS], 1);
+
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    pthread_rwlock_rdlock(&mounteddisk->dirLock);
+    listDirectory(&mounteddisk->rootdir);
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
+
+    return SUCCESS;
+}
+
+int fs_ls_dir(const char *dirname)
+{
+    char name[FS_FILENAME_LEN];
+
+    addStat(&stats.calls[FS_OP_LS], 1);
+
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    pthread_rwlock_rdlock(&mounteddisk->dirLock);
+
+    Directory *dir = resolvePath(dirname, name);
+    int entry = dir != NULL ? findFile(dir, name) : NO_ENTRY;
+
+    if(entry == NO_ENTRY || dir->subdirs[entry] == NULL)
+    {
+        pthread_rwlock_unlock(&mounteddisk->dirLock);
+        return FAILURE;
+    }
+
+    listDirectory(dir->subdirs[entry]);
+
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
+
+    return SUCCESS;
+}
+
+static int openFile(const char *filename)
+{
+    char name[FS_FILENAME_LEN];
+    struct Fileinfo new;
+    new.total_offset = 0;
+    new.block_offset = 0;
+
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    pthread_rwlock_rdlock(&mounteddisk->dirLock);
+    pthread_mutex_lock(&fdTableLock);
+
+    //Check for errors
+    Directory *dir = resolvePath(filename, name);
+
+    if(open_err_check(dir, name) != SUCCESS)
+    {
+        pthread_mutex_unlock(&fdTableLock);
+        pthread_rwlock_unlock(&mounteddisk->dirLock);
+        return FAILURE;
+    }
+
+    int entry = findFile(dir, name);
+    Rootentry *fileentry = dirEntry(dir, entry);
+
+    pthread_rwlock_rdlock(fileLock(fileentry));
+    new.first_block = firstBlock(fileentry);
+    pthread_rwlock_unlock(fileLock(fileentry));
+
+    new.block = new.first_block;
+    new.block_index = new.block == FAT_EOC ? -1 : 0;
+    new.map = NULL;
+    new.bounce = NULL;
+    new.wbuf = NULL;
+    new.map_stride = 1;
+    new.map_length = 0;
+    new.map_capacity = 0;
+    new.ra_next = 0;
+    new.ra_window = 0;
+    new.ra_end = 0;
+
+    //Random access to the file resolves blocks through its block map, unless
+    //it has extents. Without one, the fd still remembers a block every
+    //MAP_STRIDE blocks to seek backwards
+    if(!mounteddisk->geo.extents)
+    {
+        new.map_stride = mounteddisk->blockMaps ? 1 : MAP_STRIDE;
+        new.map_capacity = 16;
+        new.map = malloc(new.map_capacity * sizeof(uint32_t));
+    }
+    new.open = 1;
+    new.root = fileentry;
+
+    //The file's other descriptors share its open state
+    Openfile *node = dir->open[entry];
+
+    if(node == NULL && (node = malloc(sizeof(Openfile))) != NULL)
+    {
+        node->dir = dir;
+        node->entry = entry;
+        node->refs = 0;
+        dir->open[entry] = node;
+    }
+
+    int fd = node != NULL ? allocFd() : NO_FD;
+
+    if(fd == NO_FD)
+    {
+        if(node != NULL && node->refs == 0)
+        {
+            dir->open[entry] = NULL;
+            free(node);
+        }
+
+        free(new.map);
+        pthread_mutex_unlock(&fdTableLock);
+        pthread_rwlock_unlock(&mounteddisk->dirLock);
+        return FAILURE;
+    }
+
+    node->refs++;
+    new.node = node;
+
+    //make file info for file and place it in the free table slot
+    Fileinfo *info = fdInfo(fd);
+
+    pthread_mutex_lock(&info->lock);
+
+    //Copy everything but the slot's lock and free list link
+    new.lock = info->lock;
+    new.nextFree = NO_FD;
+    memcpy(info, &new, sizeof(Fileinfo));
+
+    pthread_mutex_unlock(&info->lock);
+
+    pthread_mutex_unlock(&fdTableLock);
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
+
+    return fd;
+}
+
+int fs_close(int fd)
+{
+    addStat(&stats.calls[FS_OP_CLOSE], 1);
+
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    //The file's directory cannot grow and move its open state meanwhile
+    pthread_rwlock_rdlock(&mounteddisk->dirLock);
+    pthread_mutex_lock(&fdTableLock);
+
+    if(lockFd(fd) != SUCCESS)
+    {
+        pthread_mutex_unlock(&fdTableLock);
+        pthread_rwlock_unlock(&mounteddisk->dirLock);
+        return FAILURE;
+    }
+
+    //Write the fd's buffered appends
+    Rootentry *file = fdInfo(fd)->root;
+
+    pthread_rwlock_wrlock(fileLock(file));
+
+    if(*appendFd(file) == fd)
+        flushAppends(file);
+
+    pthread_rwlock_unlock(fileLock(file));
+
+    fdInfo(fd)->open = 0;
+
+    free(fdInfo(fd)->wbuf);
+    fdInfo(fd)->wbuf = NULL;
+    free(fdInfo(fd)->map);
+    fdInfo(fd)->map = NULL;
+    free(fdInfo(fd)->bounce);
+    fdInfo(fd)->bounce = NULL;
+
+    //The file's last descriptor releases its open state
+    Openfile *node = fdInfo(fd)->node;
+
+    if(--node->refs == 0)
+    {
+        node->dir->open[node->entry] = NULL;
+        free(node);
+    }
+
+    pthread_mutex_unlock(&fdInfo(fd)->lock);
+    releaseFd(fd);
+    pthread_mutex_unlock(&fdTableLock);
+    pthread_rwlock_unlock(&mounteddisk->dirLock);
+
+    return SUCCESS;
+}
+
+//Get the size of fd's file
+static int sizeFd(int fd, size_t *size)
+{
+    addStat(&stats.calls[FS_OP_STAT], 1);
+
+    //Check for errors
+    if(lockFd(fd) != SUCCESS)
+        return FAILURE;
+
+    Rootentry *file = fdInfo(fd)->root;
+
+    pthread_rwlock_rdlock(fileLock(file));
+    *size = fileSize(file);
+    pthread_rwlock_unlock(fileLock(file));
+
+    pthread_mutex_unlock(&fdInfo(fd)->lock);
+
+    return SUCCESS;
+}
+
+int fs_stat(int fd)
 {
-    if(mounteddisk->superblock->numBlocks != block_disk_count())
+    size_t size;
+
+    //Return the file size, if it fits
+    if(sizeFd(fd, &size) != SUCCESS || size > INT_MAX)
         return FAILURE;
 
-    return SUCCESS;
+    return size;
 }
 
-//Make sure disk has a valid format
-static int validFormat()
+int fs_size(int fd, size_t *size)
 {
-    //Check the signature
-    if(validSignature() != SUCCESS)
-        return FAILURE;
-
-    //Check the block count
-    if(checkBlockCount() != SUCCESS)
+    if(size == NULL)
         return FAILURE;
 
-    return SUCCESS;
+    return sizeFd(fd, size);
 }
 
-
-//Get the number of free data blocks from the fat
-static int numFreeDataBlocks()
+//Move info's cursor back to the last block its map knows at or before block
+//index of its file, or to the file's first block
+static void rewindCursor(Fileinfo *info, int index)
 {
-    int numFreeBlocks = 0;
-
-    //A FAT entry of 0 corresponds to a free data block
-    for(int i = 0; i < mounteddisk->superblock->numDataBlocks; i++)
+    if(info->map == NULL || info->map_length == 0)
     {
-        if(mounteddisk->fat[i] == 0)
-            numFreeBlocks++;
+        info->block = firstBlock(info->root);
+        info->block_index = 0;
+        return;
     }
-    
 
-    return numFreeBlocks;
+    int entry = index / info->map_stride;
+
+    if(entry >= info->map_length)
+        entry = info->map_length - 1;
+
+    info->block = info->map[entry];
+    info->block_index = entry * info->map_stride;
 }
 
-//Create a new disk
-static void createNewDisk(const char *diskname)
+int fs_lseek(int fd, size_t offset)
 {
-    int namelength = strlen(diskname) + 1;
+    addStat(&stats.calls[FS_OP_LSEEK], 1);
 
-    mounteddisk = malloc(sizeof(disk));
-    
-    mounteddisk->diskname = malloc(namelength * sizeof(char));
+    if(lockFd(fd) != SUCCESS)
+        return FAILURE;
 
-    //Allocate blocks
-    mounteddisk->superblock = malloc(sizeof(Superblock));
-    
-    //Copy superblock
-    block_read(SUPERBLOCK_INDEX, mounteddisk->superblock);
-    
-    //Number of entries in FAT is 2048 per block as each entry is 16 bits
-    mounteddisk->fat = malloc(BLOCK_SIZE/2 * mounteddisk->superblock->numFATBlocks * sizeof(uint16_t));
-    
-    //Copy the FAT
-    copyFAT();
+    Rootentry *file = fdInfo(fd)->root;
 
-    //Copy root directory
-    mounteddisk->root = malloc(BLOCK_SIZE);
-    block_read(mounteddisk->superblock->rootindex, mounteddisk->root);
+    pthread_rwlock_rdlock(fileLock(file));
 
-    strcpy(mounteddisk->diskname, diskname);
-}
+    int ret = lseek_err_check(fd, offset);
 
-//sets all fat blocks in a chain to FAT EOC
-static void clearFATChain(int start_index)
-{
-    int prev; 
-    int index = start_index;
+    if(ret == SUCCESS)
+    {
+        //Set offset of file fd
+        fdInfo(fd)->total_offset = offset;
 
-    while(mounteddisk->fat[index] != FAT_EOC){
-        prev = index;
-        index = mounteddisk->fat[index];
-        mounteddisk->fat[prev] = 0;
+        //Seeking backwards past the cursor moves it back to the closest block
+        //known before the new offset
+        if((int) (offset / BLOCK_SIZE) < fdInfo(fd)->block_index)
+            rewindCursor(fdInfo(fd), offset / BLOCK_SIZE);
     }
-}
 
-static void clearRootEntry(Rootentry* root_file)
-{
-    //Save file info to that root entry
-    root_file->filename[0] = '\0';
-    root_file->filesize = 0;
-    root_file->firstdatablockindex = 0;
-}
+    pthread_rwlock_unlock(fileLock(file));
+    pthread_mutex_unlock(&fdInfo(fd)->lock);
 
-//Free mounted disk
-static void freeDisk()
-{
-    free(mounteddisk->diskname);
-    free(mounteddisk->superblock);
-    free(mounteddisk->fat);
-    free(mounteddisk->root);
-    free(mounteddisk);
+    return ret;
 }
 
-//set up file list
-static void setUpFileList()
+//Lock fd to change its file. The entry of a file in a subdirectory is in a
+//block the next commit has to hold, so room is reserved for it first, and the
+//journal committed with fd unlocked while there is none. Sets reserved to the
+//number of blocks to release once the entry is changed
+static int lockFdWrite(int fd, int *reserved)
 {
-    for(int i = 0; i < FILE_NUM; i++){
-        openfiles[i].open = 0;
+    while(1)
+    {
+        if(lockFd(fd) != SUCCESS)
+            return FAILURE;
+
+        *reserved = entryReserve(fdInfo(fd)->root);
+
+        if(tryReserveDirBlocks(*reserved) == SUCCESS)
+            return SUCCESS;
+
+        pthread_mutex_unlock(&fdInfo(fd)->lock);
+
+        if(makeDirRoom(*reserved) != SUCCESS)
+            return FAILURE;
     }
 }
 
-
-int fs_mount(const char *diskname)
+static int writeFd(int fd, void *buf, size_t count)
 {
-    //Make sure no disk is mounted
-    if(mounteddisk != NULL)
-        return FAILURE;
+    int reserved;
 
-    //Attempt to open disk.
-     
-    if(block_disk_open(diskname) != SUCCESS)
+    if(lockFdWrite(fd, &reserved) != SUCCESS)
         return FAILURE;
 
-    //Create new disk
-    createNewDisk(diskname);
+    Rootentry *file = fdInfo(fd)->root;
+    size_t offset = fdInfo(fd)->total_offset;
 
-    //Check the format
+    int written;
 
-    if(validFormat() != SUCCESS)
-        return FAILURE;
+    pthread_rwlock_wrlock(fileLock(file));
 
-    setUpFileList();
+    //Small appends are gathered into whole blocks
+    if(offset == fileSize(file) && count < BLOCK_SIZE
+       && (*appendFd(file) == fd || flushAppends(file) == SUCCESS))
+        written = bufferAppend(fd, buf, count);
 
-    return SUCCESS;
+    else if(flushAppends(file) != SUCCESS)
+        written = FAILURE;
+
+    else
+    {
+        //Write as many bytes as possible, extending the file
+        written = transferFile(fdInfo(fd), buf, count, offset, 1);
+
+        //update fileinfo (size and offset)
+        if(written != FAILURE && offset + written > fileSize(file))
+        {
+            setFileSize(file, offset + written);
+            markEntryDirty(file);
+        }
+    }
+
+    pthread_rwlock_unlock(fileLock(file));
+
+    if(written != FAILURE)
+    {
+        fdInfo(fd)->total_offset += written;
+        fdInfo(fd)->block_offset = fdInfo(fd)->total_offset % BLOCK_SIZE;
+    }
+
+    pthread_mutex_unlock(&fdInfo(fd)->lock);
+    releaseDirBlocks(reserved);
+
+    return written;
 }
 
-int fs_umount(void)
+static int readFd(int fd, void *buf, size_t count)
 {
-    //Make sure disk is mounted
-    if(mounteddisk == NULL)
+    if(lockFd(fd) != SUCCESS)
         return FAILURE;
-    
-    //Write blocks back out to disk
-    writeBlocks();
 
-    //Close the disk
-    block_disk_close();
+    Rootentry *file = fdInfo(fd)->root;
+    size_t offset = fdInfo(fd)->total_offset;
 
-    //Free the disk
-    freeDisk();
+    //Readers of a file share its lock
+    lockFileRead(file);
 
-    return SUCCESS;
+    //Never read past the end of the file
+    if(offset + count > fileSize(file))
+        count = fileSize(file) - offset;
+
+    int numRead = transferFile(fdInfo(fd), buf, count, offset, 0);
+
+    if(numRead != FAILURE)
+        readAhead(fdInfo(fd), offset, numRead);
+
+    pthread_rwlock_unlock(fileLock(file));
+
+    //shift fd offset here too
+    if(numRead != FAILURE)
+    {
+        fdInfo(fd)->total_offset += numRead;
+        fdInfo(fd)->block_offset = fdInfo(fd)->total_offset % BLOCK_SIZE;
+    }
+
+    pthread_mutex_unlock(&fdInfo(fd)->lock);
+
+    return numRead;
 }
 
-int fs_info(void)
+int fs_open(const char *filename)
 {
-    //Print info
-    printf("FS Info:\n");
-    printf("total_blk_count=%d\n", mounteddisk->superblock->numBlocks);
-    printf("fat_blk_count=%d\n", mounteddisk->superblock->numFATBlocks);
-    printf("rdir_blk=%d\n", mounteddisk->superblock->numFATBlocks + 1);
-    printf("data_blk=%d\n", mounteddisk->superblock->numFATBlocks + 2);
-    printf("data_blk_count=%d\n", mounteddisk->superblock->numDataBlocks);
-    printf("fat_free_ratio=%d/%d\n", numFreeDataBlocks(), mounteddisk->superblock->numDataBlocks);
-    printf("rdir_free_ratio=%d/%d\n", numEmptyEntriesRootDir(), ROOT_ENTRIES);
-    
-    return SUCCESS;
+    uint64_t start = clockNs();
+
+    int fd = openFile(filename);
+
+    addLatency(stats.open_latency, start);
+
+    return fd;
 }
 
-int fs_create(const char *filename)
+int fs_write(int fd, void *buf, size_t count)
 {
-    //Check for errors
-    if(create_err_check(filename) != SUCCESS)
-        return FAILURE;
+    uint64_t start = clockNs();
 
-    //Find next open root entry
-    Rootentry* open = findNextEmpty();
+    int written = writeFd(fd, buf, count);
 
-    //Save file info to that root entry
-    strcpy((char *) open->filename, filename);
-    open->filesize = 0;
-    open->firstdatablockindex = FAT_EOC;
+    if(written > 0)
+        addStat(&stats.bytes_written, written);
 
-    return SUCCESS;
+    addLatency(stats.write_latency, start);
+
+    return written;
 }
 
-int fs_delete(const char *filename)
+int fs_read(int fd, void *buf, size_t count)
 {
-    //Check for errors
-    if(delete_err_check(filename) != SUCCESS)
-        return FAILURE;
+    uint64_t start = clockNs();
 
-    //return index of failure
-    Rootentry* root_file = findFile(filename);
+    int numRead = readFd(fd, buf, count);
 
-    clearFATChain(root_file->firstdatablockindex);
+    if(numRead > 0)
+        addStat(&stats.bytes_read, numRead);
 
-    clearRootEntry(root_file);
+    addLatency(stats.read_latency, start);
 
-    return SUCCESS;
+    return numRead;
 }
 
-int fs_ls(void)
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
 {
-    printf("FS Ls:\n");
-    
-    for(int i = 0; i < ROOT_ENTRIES; i++)
+    addStat(&stats.calls[FS_OP_PWRITE], 1);
+
+    uint8_t bounce[BLOCK_SIZE];
+    Fileinfo view;
+
+    if(viewFd(fd, &view, bounce) != SUCCESS)
+        return FAILURE;
+
+    Rootentry *file = view.root;
+    int reserved = entryReserve(file);
+    int written = FAILURE;
+
+    if(reserveDirBlocks(reserved) != SUCCESS)
+        return FAILURE;
+
+    pthread_rwlock_wrlock(fileLock(file));
+
+    //Files cannot have holes
+    if(offset <= fileSize(file) && flushAppends(file) == SUCCESS)
     {
-        if(rootEntryFree(mounteddisk->root->entries[i]) != SUCCESS)
+        written = transferFile(&view, buf, count, offset, 1);
+
+        if(written != FAILURE && offset + written > fileSize(file))
         {
-            printf("file: %s,", mounteddisk->root->entries[i].filename);
-            printf(" size: %d,", mounteddisk->root->entries[i].filesize);
-            printf(" data_blk: %hu\n", mounteddisk->root->entries[i].firstdatablockindex);
+            setFileSize(file, offset + written);
+            markEntryDirty(file);
         }
-    }   
+    }
 
-    return SUCCESS;
+    pthread_rwlock_unlock(fileLock(file));
+    releaseDirBlocks(reserved);
+
+    if(written > 0)
+        addStat(&stats.bytes_written, written);
+
+    return written;
 }
 
-int fs_open(const char *filename)
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
 {
-    struct Fileinfo new;
-    new.total_offset = 0;
-    new.block_offset = 0;
+    addStat(&stats.calls[FS_OP_PREAD], 1);
 
-    //Check for errors
-    if(open_err_check(filename) != SUCCESS)
+    uint8_t bounce[BLOCK_SIZE];
+    Fileinfo view;
+
+    if(viewFd(fd, &view, bounce) != SUCCESS)
         return FAILURE;
 
-    Rootentry *fileentry = findFile(filename);
+    Rootentry *file = view.root;
+    int numRead = 0;
 
-    new.first_block = fileentry->firstdatablockindex;
-    new.block = new.first_block;
-    new.open = 1;
-    new.root = fileentry;
+    lockFileRead(file);
 
-    //make file info for file and place it in empty table slot
-    for(int i = 0; i < FILE_NUM; i++){
-        if(openfiles[i].open == 0){
-            memcpy(&openfiles[i], &new, sizeof(Fileinfo));
-            //return index of file info in table
-	    return i;
-	}
+    //Never read past the end of the file
+    if(offset < fileSize(file))
+    {
+        if(offset + count > fileSize(file))
+            count = fileSize(file) - offset;
 
+        numRead = transferFile(&view, buf, count, offset, 0);
     }
 
-    return FAILURE;
-}
-
-int fs_close(int fd)
-{
-    if(close_err_check(fd) != SUCCESS)
-        return FAILURE;
+    pthread_rwlock_unlock(fileLock(file));
 
-    openfiles[fd].open = 0;
+    if(numRead > 0)
+        addStat(&stats.bytes_read, numRead);
 
-    return SUCCESS;
+    return numRead;
 }
 
-int fs_stat(int fd)
+//Move a request whose block transfers are all done to the ready list, copying
+//the partial blocks of a read to the caller's buffer. Called with aioLock held
+static void aioFinish(Aiostate *state)
 {
-    //Check for errors
-    if(stat_err_check(fd) != SUCCESS)
-        return FAILURE;
+    struct fs_aio *req = state->req;
+    uint8_t *buf = req->buf;
 
-    //Return the file size
-    return openfiles[fd].root->filesize;
-}
+    if(state->failed)
+        req->result = FAILURE;
 
-int fs_lseek(int fd, size_t offset)
-{
-    if(lseek_err_check(fd, offset) != SUCCESS)
-        return FAILURE;
+    else
+    {
+        if(state->headLen > 0)
+            memcpy(buf, &state->bounce[state->headOffset], state->headLen);
+
+        if(state->tailLen > 0)
+            memcpy(&buf[state->tailPos], &state->bounce[BLOCK_SIZE], state->tailLen);
+    }
 
-    //Set offset of file fd
-    openfiles[fd].total_offset = offset;
+    free(state->bounce);
+    free(state->transfers);
+    free(state->transferList);
+    state->bounce = NULL;
+    state->transfers = NULL;
+    state->transferList = NULL;
 
+    state->next = NULL;
 
-    return SUCCESS;
+    if(aioReadyTail != NULL)
+        aioReadyTail->next = state;
+    else
+        aioReady = state;
+
+    aioReadyTail = state;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+//Set up the block transfers of an asynchronous read. Blocks found in the cache
+//are copied right away, the others are to be read from disk straight into the
+//caller's buffer (partial first and last blocks into the bounce buffer)
+static int aioStartRead(Aiostate *state)
 {
-    if(write_err_check(fd) != SUCCESS)
+    struct fs_aio *req = state->req;
+    uint8_t *buf = req->buf;
+    size_t count = req->count;
+    Fileinfo view;
+
+    if(viewFd(req->fd, &view, NULL) != SUCCESS)
         return FAILURE;
 
-    //Find the starting data block (the data block at the offset)
-    int dataBlock = getDataBlock(fd);
+    Rootentry *file = view.root;
 
-    //Get the number of blocks that must be written
-    int numBlocks = numBlocksToWrite(fd, count);
+    lockFileRead(file);
 
-    //Allocate dummy buffer to store data to be written
-    uint8_t *tempbuf = malloc(numBlocks * BLOCK_SIZE);
-    
-    //read from first block to buffer, then modify point after offset
-    block_read(dataBlock + mounteddisk->superblock->datastartindex, tempbuf);
-    memcpy(&tempbuf[openfiles[fd].block_offset], buf, count);
+    //Never read past the end of the file
+    if(req->offset >= fileSize(file))
+        count = 0;
+
+    else if(req->offset + count > fileSize(file))
+        count = fileSize(file) - req->offset;
 
-    //if nothing has been written for this file yet
-    if(dataBlock == -1)
+    req->result = count;
+
+    if(count == 0)
     {
-        //get new first block, save root stuff
-        dataBlock = findFreeFAT();
+        pthread_rwlock_unlock(fileLock(file));
+        return SUCCESS;
+    }
 
-	if(dataBlock == FAILURE)
-             return FAILURE;
+    int first = req->offset / BLOCK_SIZE;
+    size_t blockOffset = req->offset % BLOCK_SIZE;
+    int numBlocks = (blockOffset + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t *blocks = malloc(numBlocks * sizeof(uint32_t));
 
-        mounteddisk->fat[dataBlock] = FAT_EOC;
+    state->bounce = malloc(2 * BLOCK_SIZE);
+    state->transfers = malloc(numBlocks * sizeof(struct block_aio));
+    state->transferList = malloc(numBlocks * sizeof(struct block_aio *));
 
-        openfiles[fd].root->firstdatablockindex = dataBlock;
+    if(blocks == NULL || state->bounce == NULL || state->transfers == NULL || state->transferList == NULL
+       || collectBlocks(&view, first, numBlocks, 0, blocks) != numBlocks)
+    {
+        pthread_rwlock_unlock(fileLock(file));
+        free(blocks);
+        return FAILURE;
     }
-    
-    //write to the first block 
-    block_write(dataBlock + mounteddisk->superblock->datastartindex, tempbuf);
- 
-    numBlocks--;
- 
-    //write the remaining blocks
+
+    state->headOffset = blockOffset;
+
+    size_t position = 0;
+
     for(int i = 0; i < numBlocks; i++)
     {
-        //Get the next block
-        dataBlock = nextBlock(dataBlock);
+        size_t len = BLOCK_SIZE - (i == 0 ? blockOffset : 0);
+        uint8_t *dest = &buf[position];
 
-	if(dataBlock == FAT_EOC)
+        if(len > count - position)
+            len = count - position;
+
+        //Partial block, through the bounce buffer
+        if(len < BLOCK_SIZE)
         {
-            dataBlock = allocNewFATEntry(dataBlock);
+            dest = &state->bounce[i == 0 ? 0 : BLOCK_SIZE];
+
+            if(i == 0)
+                state->headLen = len;
 
-            //return failure if no data blocks are open
-	    if(dataBlock == -1)
+            else
             {
-                return FAILURE;
-	    }
-	}
+                state->tailPos = position;
+                state->tailLen = len;
+            }
+        }
+
+        position += len;
+
+        //Cached blocks may be newer than the disk
+        size_t diskBlock = blocks[i] + mounteddisk->geo.datastartindex;
 
-	//adjust offset
-        openfiles[fd].block = dataBlock;
+        if(cache_peek(diskBlock, dest) == SUCCESS)
+            continue;
 
-        //Write to it
-        block_write(dataBlock + mounteddisk->superblock->datastartindex, &tempbuf);
+        //Extend the previous transfer if the block and its destination follow it
+        if(state->pending > 0)
+        {
+            struct block_aio *prev = &state->transfers[state->pending - 1];
+
+            if(prev->block + prev->count == diskBlock && (uint8_t *) prev->buf + prev->count * BLOCK_SIZE == dest)
+            {
+                prev->count++;
+                continue;
+            }
+        }
+
+        struct block_aio *transfer = &state->transfers[state->pending];
+
+        transfer->block = diskBlock;
+        transfer->count = 1;
+        transfer->buf = dest;
+        transfer->write = 0;
+        transfer->data = state;
+        state->transferList[state->pending++] = transfer;
     }
 
-    free(tempbuf);
+    pthread_rwlock_unlock(fileLock(file));
+    free(blocks);
 
-    //update fileinfo (size and offset) 
-    openfiles[fd].root->filesize = openfiles[fd].block_offset + count;
-    
-    //shift block offset here too
-    openfiles[fd].total_offset += count;
+    return SUCCESS;
+}
+
+int fs_aio_submit(struct fs_aio **reqs, size_t count)
+{
+    addStat(&stats.calls[FS_OP_AIO_SUBMIT], 1);
+
+    //Make sure disk is mounted
+    if(mounteddisk == NULL)
+        return FAILURE;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        struct fs_aio *req = reqs[i];
+        Aiostate *state = calloc(1, sizeof(Aiostate));
+
+        if(state == NULL)
+            return i > 0 ? (int) i : FAILURE;
+
+        state->req = req;
+        req->priv = state;
+
+        //Writes only go as far as the block cache, they are done right away
+        if(req->write)
+            req->result = fs_pwrite(req->fd, req->buf, req->count, req->offset);
+
+        else if(aioStartRead(state) != SUCCESS)
+        {
+            state->failed = 1;
+            state->pending = 0;
+        }
+
+        pthread_mutex_lock(&aioLock);
+
+        //Queue all the block transfers at once, so that waiters see them
+        if(state->pending > 0 && block_aio_submit(state->transferList, state->pending) == SUCCESS)
+            aioWaiting++;
+
+        else
+        {
+            state->failed |= state->pending > 0;
+            aioFinish(state);
+        }
+
+        pthread_mutex_unlock(&aioLock);
+    }
 
     return count;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_aio_wait(struct fs_aio **done, size_t min, size_t max)
 {
-    if(read_err_check(fd) != SUCCESS)
-        return FAILURE;
+    struct block_aio *finished[AIO_REAP_BATCH];
+    size_t n = 0;
 
-    //Find the starting data block (the data block at the offset)
-    int dataBlock = getDataBlock(fd);
+    if(min > max)
+        min = max;
 
-    //Get the number of blocks that must be read
-    int numBlocks = numBlocksToRead(fd, count);
+    pthread_mutex_lock(&aioWaitLock);
+    pthread_mutex_lock(&aioLock);
 
-    //Allocate dummy buffer to store all blocks
-    uint8_t *tempbuf = malloc(numBlocks * BLOCK_SIZE);
+    while(n < max)
+    {
+        //Hand out the completed requests
+        while(n < max && aioReady != NULL)
+        {
+            Aiostate *state = aioReady;
 
-    //Read the first block into the dummy buffer
-    block_read(dataBlock + mounteddisk->superblock->datastartindex, tempbuf);   
+            aioReady = state->next;
 
-    numBlocks--;
+            if(aioReady == NULL)
+                aioReadyTail = NULL;
 
-    //Read the remaining blocks
-    for(int i = 0; i < numBlocks; i++)
+            done[n++] = state->req;
+            state->req->priv = NULL;
+            free(state);
+        }
+
+        //Stop once enough requests completed, or if no more can complete
+        if(n >= min || aioWaiting == 0)
+            break;
+
+        pthread_mutex_unlock(&aioLock);
+        int reaped = block_aio_wait(finished, 1, AIO_REAP_BATCH);
+        pthread_mutex_lock(&aioLock);
+
+        if(reaped == FAILURE)
+            break;
+
+        for(int i = 0; i < reaped; i++)
+        {
+            Aiostate *state = finished[i]->data;
+
+            if(finished[i]->result != SUCCESS)
+                state->failed = 1;
+
+            if(--state->pending == 0)
+            {
+                aioWaiting--;
+                aioFinish(state);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&aioLock);
+    pthread_mutex_unlock(&aioWaitLock);
+
+    return n;
+}
+
+int fs_fallocate(int fd, size_t size)
+{
+    addStat(&stats.calls[FS_OP_FALLOCATE], 1);
+
+    int reserved;
+
+    if(lockFdWrite(fd, &reserved) != SUCCESS)
+        return FAILURE;
+
+    Rootentry *file = fdInfo(fd)->root;
+    int wanted = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int numBlocks = 0;
+    int last = FAILURE;
+    int ret = SUCCESS;
+
+    pthread_rwlock_wrlock(fileLock(file));
+    pthread_mutex_lock(&mounteddisk->fatLock);
+
+    //Count the blocks the file already has
+    if(mounteddisk->geo.extents)
+        numBlocks = extentBlocks(fileExtents(file));
+
+    else
     {
-        //Get the next block
-        dataBlock = nextBlock(dataBlock);
+        for(int block = firstBlock(file); block != FAT_EOC; block = nextBlock(block))
+        {
+            last = block;
+            numBlocks++;
+        }
+
+        addStat(&stats.chain_steps, numBlocks);
+    }
 
-	//adjust offset
-	openfiles[fd].block = dataBlock;
+    //Fail without allocating anything if the disk cannot hold the file
+    if(numBlocks < wanted && wanted - numBlocks > numFreeDataBlocks())
+        ret = FAILURE;
 
-        //Read it
-        block_read(dataBlock + mounteddisk->superblock->datastartindex, &tempbuf[(i + 1) * BLOCK_SIZE]);
+    //The extents may run out before the disk does
+    else if(numBlocks < wanted && mounteddisk->geo.extents)
+    {
+        if(growExtents(file, wanted - numBlocks) < wanted - numBlocks)
+            ret = FAILURE;
     }
 
-    //Copy from temporary buffer, starting at the block offset
-    memcpy(buf, &tempbuf[openfiles[fd].block_offset], count);
-     
-    free(tempbuf);
+    else if(numBlocks < wanted)
+    {
+        int allocated;
+        int first = extendChain(last, wanted - numBlocks, &allocated);
 
-    //shift fd offset here too
-    openfiles[fd].total_offset += count;
+        if(last == FAILURE)
+        {
+            setFirstBlock(file, first);
+            markEntryDirty(file);
+        }
+    }
 
-    return count;
-}
+    pthread_mutex_unlock(&mounteddisk->fatLock);
+    pthread_rwlock_unlock(fileLock(file));
+    pthread_mutex_unlock(&fdInfo(fd)->lock);
+    releaseDirBlocks(reserved);
 
+    return ret;
+}
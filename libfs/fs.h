@@ -9,22 +9,163 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Default maximum number of open file descriptors */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of data blocks of a file system (version 1, 16-bit FAT) */
+#define FS_DATA_BLOCKS_MAX 8192
+
+/** Maximum number of data blocks of a version 2 file system (32-bit FAT) */
+#define FS2_DATA_BLOCKS_MAX (1 << 30)
+
+/** Default size of the block cache, in blocks */
+#define FS_CACHE_BLOCKS 256
+
+/** Default largest read-ahead window, in blocks */
+#define FS_READAHEAD_BLOCKS 32
+
+/** Default time between two commits of the journal, in milliseconds */
+#define FS_COMMIT_INTERVAL 1000
+
+/*
+ * Files are named by paths: names of at most %FS_FILENAME_LEN characters
+ * (including the NULL character) separated by '/', each but the last naming a
+ * directory, starting from the root directory with or without a leading '/'.
+ * The root directory holds up to %FS_FILE_MAX_COUNT entries, while other
+ * directories grow as needed. Finding an entry takes the same time whatever the
+ * number of entries of its directory. File systems formatted with extents only
+ * have the root directory.
+ */
+
+/*
+ * Once a file system is mounted, all functions but fs_mount(), fs_mount_opts()
+ * and fs_umount() can be called from several threads at once. Concurrent reads
+ * of the same file proceed in parallel, while writes to a file are serialized.
+ * A file descriptor can be shared between threads, but its file offset is then
+ * shared as well.
+ */
+
+/**
+ * struct fs_format_options - Tunables for fs_format()
+ * @journal: If non-zero, reserve the journal used when mounting with the
+ * @journal option of struct fs_mount_options, at the start of the data blocks.
+ * Otherwise it is reserved on the first such mount, wherever there is room.
+ * @preallocate: If non-zero, allocate storage for the whole virtual disk file
+ * instead of leaving the data blocks as a hole in it, so that later writes
+ * cannot fail for lack of space.
+ * @version: Version of the on-disk format. Version 1 is the original format,
+ * with a 16-bit FAT and 32-bit file sizes, for up to %FS_DATA_BLOCKS_MAX data
+ * blocks. Version 2 has a 32-bit FAT and 64-bit file sizes, for up to
+ * %FS2_DATA_BLOCKS_MAX data blocks (4 TiB). 0 selects version 1 if it can hold
+ * the file system, version 2 otherwise.
+ * @extents: If non-zero, store each file as a list of extents (runs of
+ * contiguous data blocks) instead of a chain in the FAT, which then only tells
+ * which blocks are used. Finding the block at any offset of a file takes a
+ * binary search over its extents rather than a walk through the FAT. A file can
+ * have up to 340 extents, which only a badly fragmented disk makes it run out
+ * of. Requires version 2 (selected by a @version of 0).
+ */
+struct fs_format_options {
+	int journal;
+	int preallocate;
+	int version;
+	int extents;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @nblocks: Number of data blocks
+ * @opts: Format options, or NULL for the defaults
+ *
+ * Create virtual disk file @diskname, replacing any existing file, with an
+ * empty file system of @nblocks data blocks that can be mounted with
+ * fs_mount(). Only the superblock and the start of the FAT are written, at
+ * once: the rest of the metadata is zeroes, left as a hole in the file along
+ * with the data blocks, so the time taken hardly depends on @nblocks. The disk
+ * layer handles a single virtual disk at a time, so no file system can be
+ * mounted meanwhile.
+ *
+ * Return: -1 if @nblocks is 0 or too large for the format version, or cannot
+ * hold the journal, if a file system is mounted, or if the virtual disk file
+ * cannot be created or written. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t nblocks,
+	      const struct fs_format_options *opts);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). Both versions of the format
+ * (see struct fs_format_options) are recognized by their signature.
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * struct fs_mount_options - Tunables for fs_mount_opts()
+ * @mmap: If non-zero, map the whole virtual disk file in memory. The file
+ * system's metadata is then accessed in place instead of being copied, and
+ * file data is transferred with memory copies instead of system calls.
+ * @cache_blocks: Size of the block cache in blocks. 0 selects the default
+ * (%FS_CACHE_BLOCKS), and a negative value disables the cache. The cache is
+ * always disabled with @mmap.
+ * @block_maps: If non-zero, keep for every open file a map from block number
+ * within the file to data block, built as the file is accessed. Reading or
+ * writing at an arbitrary offset then costs no walk through the FAT, at the
+ * price of four bytes of memory per block of the file. Files stored as extents
+ * (see struct fs_format_options) need no map and never get one.
+ * @readahead: Largest number of blocks read ahead of a file descriptor that is
+ * read sequentially with fs_read(). 0 selects the default
+ * (%FS_READAHEAD_BLOCKS), and a negative value disables read-ahead. Blocks are
+ * read ahead into the block cache, so read-ahead is disabled along with it, and
+ * limited to half of its size.
+ * @journal: If non-zero, changes of the file system's metadata are committed
+ * to a journal on the disk before they are written in place, so that mounting
+ * the disk after a crash brings it back to the last commit. All the changes
+ * made since the previous commit are written to the journal at once, and made
+ * durable along with the blocks written so far; the virtual disk file is
+ * flushed before and after the journal is written. The journal takes a few
+ * data blocks, reserved on the first mount with @journal. With @mmap, only file data is accessed in place. A
+ * version 2 file system can only be journaled up to about a million data
+ * blocks (4 GiB), as a commit lists its blocks in a single header block. A
+ * commit holds up to 64 blocks of directories other than the root directory,
+ * and changes to them past that wait for the next commit.
+ * @commit_interval: Time between two commits of the journal, in milliseconds.
+ * 0 selects the default (%FS_COMMIT_INTERVAL), and a negative value leaves
+ * commits to fs_sync() and fs_fsync().
+ * @open_max: Largest number of file descriptors open at once. 0 selects the
+ * default (%FS_OPEN_MAX_COUNT), and a negative value lifts the limit. The
+ * table of file descriptors grows as files are opened, and opening or closing
+ * a file takes the same time whatever the number of open descriptors.
+ */
+struct fs_mount_options {
+	int mmap;
+	int cache_blocks;
+	int block_maps;
+	int readahead;
+	int journal;
+	int commit_interval;
+	int open_max;
+};
+
+/**
+ * fs_mount_opts - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount(), but the mounting behavior can be tuned with @opts.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_opts(const char *diskname, const struct fs_mount_options *opts);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -36,6 +177,133 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write file system changes to disk
+ *
+ * Write the modified parts of the file system's metadata and every modified
+ * block held in the block cache back to the virtual disk file. This is done
+ * implicitly by fs_umount().
+ *
+ * With a journal (see struct fs_mount_options), commit the journal and wait
+ * until it is durable. Calls made from several threads while a commit is being
+ * written are served together by the next one.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if writing to it
+ * fails. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_fsync - Write a file's changes to disk
+ * @fd: File descriptor
+ *
+ * Write the appends buffered by file descriptor @fd (see fs_write()), then
+ * every change of the file system, to the virtual disk file like fs_sync().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if writing to the virtual disk fails. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * struct fs_cache_stats - Block cache counters
+ * @hits: Block accesses served from the cache
+ * @misses: Block accesses that had to go to disk
+ * @evictions: Blocks dropped from the cache to make room for another block
+ * @writebacks: Modified blocks written back to disk
+ * @prefetched: Blocks read ahead in the cache
+ */
+struct fs_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+	size_t prefetched;
+};
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Filled with the counters accumulated since the file system was
+ * mounted
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
+/** Number of buckets of the latency histograms of struct fs_stats */
+#define FS_LATENCY_BUCKETS 32
+
+/**
+ * enum fs_op - Operations counted by struct fs_stats
+ */
+enum fs_op {
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_LS,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_OP_PREAD,
+	FS_OP_PWRITE,
+	FS_OP_FALLOCATE,
+	FS_OP_AIO_SUBMIT,
+	FS_OP_SYNC,
+	FS_OP_FSYNC,
+	FS_OP_MKDIR,
+	FS_OP_COUNT
+};
+
+/**
+ * struct fs_stats - File system activity counters
+ * @calls: Number of calls of each operation, indexed by enum fs_op
+ * @bytes_read: Bytes returned by fs_read() and fs_pread()
+ * @bytes_written: Bytes written by fs_write() and fs_pwrite()
+ * @disk_reads: Read requests issued to the virtual disk (see block_get_stats())
+ * @disk_writes: Write requests issued to the virtual disk
+ * @blocks_read: Blocks read from the virtual disk
+ * @blocks_written: Blocks written to the virtual disk
+ * @chain_steps: FAT entries followed while walking the chains of files
+ * @allocations: Searches for a run of free blocks
+ * @alloc_scanned: Words of 64 blocks of the free-block bitmap examined by those
+ * searches
+ * @read_latency: Latency histogram of fs_read(): @read_latency[i] counts the
+ * calls that took between 2^i and 2^(i+1) - 1 nanoseconds, the last bucket
+ * counting all longer calls
+ * @write_latency: Latency histogram of fs_write()
+ * @open_latency: Latency histogram of fs_open()
+ *
+ * Transfers served by the block cache issue no request to the virtual disk.
+ */
+struct fs_stats {
+	size_t calls[FS_OP_COUNT];
+	size_t bytes_read;
+	size_t bytes_written;
+	size_t disk_reads;
+	size_t disk_writes;
+	size_t blocks_read;
+	size_t blocks_written;
+	size_t chain_steps;
+	size_t allocations;
+	size_t alloc_scanned;
+	size_t read_latency[FS_LATENCY_BUCKETS];
+	size_t write_latency[FS_LATENCY_BUCKETS];
+	size_t open_latency[FS_LATENCY_BUCKETS];
+};
+
+/**
+ * fs_stats - Get file system activity counters
+ * @stats: Filled with the counters accumulated since the file system was
+ * mounted
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
 /**
  * fs_info - Display information about file system
  *
@@ -49,53 +317,81 @@ int fs_info(void);
  * fs_create - Create a new file
  * @filename: File name
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file named by path @filename on the mounted file
+ * system. String @filename must be NULL-terminated and each of its names cannot
+ * exceed %FS_FILENAME_LEN characters (including the NULL character).
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if string @filename is too long, if the directory of @filename does not
+ * exist, if it is the root directory and already contains %FS_FILE_MAX_COUNT
+ * files, or if the disk is full. 0 otherwise.
  */
 int fs_create(const char *filename);
 
+/**
+ * fs_mkdir - Create a new directory
+ * @dirname: Directory name
+ *
+ * Create a new and empty directory named by path @dirname on the mounted file
+ * system, like fs_create() creates a file. A directory takes no data block
+ * until it holds an entry, and then one for every 127 entries.
+ *
+ * Return: -1 if fs_create() would fail for @dirname, or if the file system has
+ * extents. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
 /**
  * fs_delete - Delete a file
  * @filename: File name
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file or the empty directory named by path @filename from the
+ * mounted file system.
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * delete, if file @filename is currently open, or if directory @filename is not
+ * empty. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files and directories located in the root
+ * directory.
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
 int fs_ls(void);
 
+/**
+ * fs_ls_dir - List files of a directory
+ * @dirname: Directory name
+ *
+ * List information about the files and directories located in the directory
+ * named by path @dirname, like fs_ls().
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if there is no
+ * directory named @dirname. 0 otherwise.
+ */
+int fs_ls_dir(const char *dirname);
+
 /**
  * fs_open - Open a file
  * @filename: File name
  *
- * Open file named @filename for reading and writing, and return the
+ * Open file named by path @filename for reading and writing, and return the
  * corresponding file descriptor. The file descriptor is a non-negative integer
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * simultaneously, unless another limit is set when mounting (see struct
+ * fs_mount_options). The file descriptors of closed files are reused.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the limit of files currently open is reached. Otherwise, return the
+ * file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -117,10 +413,25 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the current size of file.
+ * open), or if the size does not fit in an int (see fs_size()). Otherwise
+ * return the current size of file.
  */
 int fs_stat(int fd);
 
+/**
+ * fs_size - Get file size
+ * @fd: File descriptor
+ * @size: Size of the file
+ *
+ * Get the current size of the file pointed by file descriptor @fd, like
+ * fs_stat() but for files of any size, as a version 2 file system can hold
+ * files larger than 2 GiB.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open) or @size is NULL. 0 otherwise.
+ */
+int fs_size(int fd, size_t *size);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -152,6 +463,11 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * Writes of less than a block at the end of the file are gathered in a buffer
+ * of the file descriptor, which is written to the file's last block once it is
+ * full, when the file is read or written otherwise, or by fs_close(), fs_fsync()
+ * and fs_sync().
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
  */
@@ -172,9 +488,120 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * When a file descriptor is read sequentially, the following blocks of the file
+ * are read ahead in the background, in a window that grows as long as the reads
+ * stay sequential.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset instead of the file offset of file
+ * descriptor @fd, which is left untouched. Several threads can therefore
+ * share a file descriptor without seeking.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is beyond the end of the file. Otherwise return the
+ * number of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read from @offset instead of the file offset of file
+ * descriptor @fd, which is left untouched. Reads of the same file, even through
+ * the same file descriptor, proceed concurrently.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read (0 if @offset is
+ * at or beyond the end of the file).
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * struct fs_aio - Asynchronous file transfer
+ * @fd: File descriptor
+ * @write: Non-zero to write to the file, zero to read from it
+ * @buf: Data buffer
+ * @count: Number of bytes of data to be transferred
+ * @offset: File offset to transfer at
+ * @result: Set on completion, to what fs_pwrite() or fs_pread() would have
+ * returned
+ * @data: Free for the caller's use
+ * @priv: Used internally while the request is in flight
+ */
+struct fs_aio {
+	int fd;
+	int write;
+	void *buf;
+	size_t count;
+	size_t offset;
+	int result;
+	void *data;
+	void *priv;
+};
+
+/**
+ * fs_aio_submit - Start asynchronous file transfers
+ * @reqs: Array of pointers to the requests
+ * @count: Number of elements in @reqs
+ *
+ * Start the transfers described by @reqs and return without waiting for them.
+ * The data blocks of a read that are not in the block cache are read from disk
+ * in the background (through io_uring when the kernel allows it, by worker
+ * threads otherwise), so that many of them can be in flight at once. Writes
+ * only need to reach the block cache and are carried out before returning.
+ *
+ * The requests, their buffers and their file descriptors must stay valid until
+ * the requests are returned by fs_aio_wait(). The content read from a range of
+ * a file that is being written at the same time is undefined.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if no request could
+ * be started. Otherwise the number of requests started (an invalid request
+ * completes with a @result of -1).
+ */
+int fs_aio_submit(struct fs_aio **reqs, size_t count);
+
+/**
+ * fs_aio_wait - Wait for asynchronous file transfers
+ * @done: Array filled with pointers to the completed requests
+ * @min: Minimum number of completed requests to wait for
+ * @max: Maximum number of completed requests to return (size of @done)
+ *
+ * Wait until at least @min of the requests started by fs_aio_submit() have
+ * completed, or fewer if fewer are in flight. With a @min of 0, only collect
+ * the requests that already completed.
+ *
+ * Return: The number of completed requests placed in @done.
+ */
+int fs_aio_wait(struct fs_aio **done, size_t min, size_t max);
+
+/**
+ * fs_fallocate - Preallocate space for a file
+ * @fd: File descriptor
+ * @size: Number of bytes the file should be able to hold
+ *
+ * Make sure that the file referenced by file descriptor @fd has enough data
+ * blocks to hold @size bytes, allocating the missing ones (contiguously if
+ * possible) without writing them. The size of the file is not changed, but
+ * subsequent writes up to @size bytes do not need to allocate any block.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there are not enough free data blocks on disk. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t size);
+
 #endif /* _FS_H */
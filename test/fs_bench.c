@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define BLOCK_SIZE 4096
+
+/* Smallest scratch disk that fits every benchmark */
+#define MIN_DATA_BLOCKS 4096
+
+/* Largest file used by the transfer benchmarks */
+#define MAX_FILE_SIZE (16 << 20)
+
+/* Chunk sizes of the sequential transfers */
+static const size_t chunk_sizes[] = { 512, 4096, 65536, 1 << 20 };
+
+/* Number of operations of the other benchmarks */
+#define RAND_READS	20000
+#define APPENDS		65536
+#define APPEND_SIZE	64
+#define OPENS		100000
+#define CREATES		20000
+#define MOUNTS		100
+#define DIR_FILES	20000
+#define HELD_FDS	65536
+
+struct result {
+	const char *name;
+	size_t param;
+	double value;
+	const char *unit;
+};
+
+static struct result results[32];
+static int nresults;
+
+static const char *diskname = "bench.fs";
+static size_t data_blocks = FS_DATA_BLOCKS_MAX;
+static struct fs_mount_options opts;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t param, double value,
+		   const char *unit)
+{
+	if (nresults == ARRAY_SIZE(results))
+		die("too many results");
+
+	results[nresults++] = (struct result){ name, param, value, unit };
+	fprintf(stderr, "%-14s %8zu %12.1f %s\n", name, param, value, unit);
+}
+
+static void mount_disk(void)
+{
+	if (fs_mount_opts(diskname, &opts))
+		die("cannot mount '%s'", diskname);
+}
+
+static void umount_disk(void)
+{
+	if (fs_umount())
+		die("cannot unmount '%s'", diskname);
+}
+
+static int open_file(const char *name, int create)
+{
+	int fd;
+
+	if (create && fs_create(name))
+		die("cannot create '%s'", name);
+
+	fd = fs_open(name);
+	if (fd < 0)
+		die("cannot open '%s'", name);
+	return fd;
+}
+
+/* Transfer @size bytes in chunks of @chunk; return the rate in MiB/s */
+static double transfer(int fd, char *buf, size_t size, size_t chunk,
+		       int write)
+{
+	double start = now();
+	size_t done;
+	int ret;
+
+	for (done = 0; done < size; done += chunk) {
+		if (write)
+			ret = fs_write(fd, buf, chunk);
+		else
+			ret = fs_read(fd, buf, chunk);
+		if (ret != (int)chunk)
+			die("short transfer at offset %zu", done);
+	}
+
+	/* Writes count once they are out of the cache */
+	if (write && fs_sync())
+		die("cannot sync");
+
+	return size / (double)(1 << 20) / (now() - start);
+}
+
+static void bench_sequential(size_t size)
+{
+	char *buf = malloc(chunk_sizes[ARRAY_SIZE(chunk_sizes) - 1]);
+	size_t i;
+	int fd;
+
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 'x', chunk_sizes[ARRAY_SIZE(chunk_sizes) - 1]);
+
+	for (i = 0; i < ARRAY_SIZE(chunk_sizes); i++) {
+		mount_disk();
+		fd = open_file("seq", 1);
+		report("seq_write", chunk_sizes[i],
+		       transfer(fd, buf, size, chunk_sizes[i], 1), "MiB/s");
+		fs_close(fd);
+		umount_disk();
+
+		/* Read back from a cold cache */
+		mount_disk();
+		fd = open_file("seq", 0);
+		report("seq_read", chunk_sizes[i],
+		       transfer(fd, buf, size, chunk_sizes[i], 0), "MiB/s");
+		fs_close(fd);
+		if (fs_delete("seq"))
+			die("cannot delete 'seq'");
+		umount_disk();
+	}
+
+	free(buf);
+}
+
+static void bench_random_read(size_t size)
+{
+	char buf[BLOCK_SIZE];
+	size_t nblocks = size / BLOCK_SIZE;
+	double start;
+	int fd, i;
+
+	memset(buf, 'r', BLOCK_SIZE);
+	mount_disk();
+	fd = open_file("rand", 1);
+	for (i = 0; i < (int)nblocks; i++)
+		if (fs_write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE)
+			die("cannot fill 'rand'");
+	fs_close(fd);
+	umount_disk();
+
+	mount_disk();
+	fd = open_file("rand", 0);
+	srand(1);
+	start = now();
+	for (i = 0; i < RAND_READS; i++) {
+		size_t offset = (size_t)(rand() % nblocks) * BLOCK_SIZE;
+
+		if (fs_pread(fd, buf, BLOCK_SIZE, offset) != BLOCK_SIZE)
+			die("cannot read 'rand'");
+	}
+	report("rand_read", BLOCK_SIZE, RAND_READS / (now() - start), "IOPS");
+	fs_close(fd);
+	fs_delete("rand");
+	umount_disk();
+}
+
+static void bench_append(void)
+{
+	char buf[APPEND_SIZE];
+	double start;
+	int fd, i;
+
+	memset(buf, 'a', APPEND_SIZE);
+	mount_disk();
+	fd = open_file("append", 1);
+	start = now();
+	for (i = 0; i < APPENDS; i++)
+		if (fs_write(fd, buf, APPEND_SIZE) != APPEND_SIZE)
+			die("cannot append");
+	if (fs_fsync(fd))
+		die("cannot sync");
+	report("append", APPEND_SIZE, APPENDS / (now() - start), "ops/s");
+	fs_close(fd);
+	fs_delete("append");
+	umount_disk();
+}
+
+/* Directory operations with the root directory full */
+static void bench_metadata(void)
+{
+	char name[FS_FILENAME_LEN];
+	double start, create = 0, delete = 0;
+	int i, fd;
+
+	mount_disk();
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		snprintf(name, sizeof(name), "meta%d", i);
+		if (fs_create(name))
+			die("cannot create '%s'", name);
+	}
+
+	srand(1);
+	start = now();
+	for (i = 0; i < OPENS; i++) {
+		snprintf(name, sizeof(name), "meta%d",
+			 rand() % FS_FILE_MAX_COUNT);
+		fd = fs_open(name);
+		if (fd < 0 || fs_close(fd))
+			die("cannot open '%s'", name);
+	}
+	report("open_close", FS_FILE_MAX_COUNT, OPENS / (now() - start),
+	       "ops/s");
+
+	for (i = 0; i < CREATES; i++) {
+		snprintf(name, sizeof(name), "meta%d",
+			 rand() % FS_FILE_MAX_COUNT);
+		start = now();
+		if (fs_delete(name))
+			die("cannot delete '%s'", name);
+		delete += now() - start;
+		start = now();
+		if (fs_create(name))
+			die("cannot create '%s'", name);
+		create += now() - start;
+	}
+	report("create", FS_FILE_MAX_COUNT, CREATES / create, "ops/s");
+	report("delete", FS_FILE_MAX_COUNT, CREATES / delete, "ops/s");
+	umount_disk();
+
+	/* Mounting reads the whole full root directory */
+	start = now();
+	for (i = 0; i < MOUNTS; i++) {
+		mount_disk();
+		umount_disk();
+	}
+	report("mount", FS_FILE_MAX_COUNT, (now() - start) / MOUNTS * 1e6,
+	       "us");
+}
+
+/* Directory operations in a subdirectory far larger than the root directory */
+static void bench_directory(void)
+{
+	char name[2 * FS_FILENAME_LEN];
+	double start;
+	int i, fd;
+
+	mount_disk();
+	if (fs_mkdir("dir"))
+		die("cannot create 'dir'");
+
+	start = now();
+	for (i = 0; i < DIR_FILES; i++) {
+		snprintf(name, sizeof(name), "dir/file%d", i);
+		if (fs_create(name))
+			die("cannot create '%s'", name);
+	}
+	report("dir_create", DIR_FILES, DIR_FILES / (now() - start), "ops/s");
+
+	srand(1);
+	start = now();
+	for (i = 0; i < OPENS; i++) {
+		snprintf(name, sizeof(name), "dir/file%d", rand() % DIR_FILES);
+		fd = fs_open(name);
+		if (fd < 0 || fs_close(fd))
+			die("cannot open '%s'", name);
+	}
+	report("dir_open", DIR_FILES, OPENS / (now() - start), "ops/s");
+
+	start = now();
+	for (i = 0; i < DIR_FILES; i++) {
+		snprintf(name, sizeof(name), "dir/file%d", i);
+		if (fs_delete(name))
+			die("cannot delete '%s'", name);
+	}
+	report("dir_delete", DIR_FILES, DIR_FILES / (now() - start), "ops/s");
+
+	if (fs_delete("dir"))
+		die("cannot delete 'dir'");
+	umount_disk();
+}
+
+/* Opening and closing a file while many descriptors are held open */
+static void bench_open_many(void)
+{
+	static int fds[HELD_FDS];
+	struct fs_mount_options saved = opts;
+	double start;
+	int i, fd;
+
+	opts.open_max = -1;
+	mount_disk();
+	if (fs_create("held") || fs_create("opened"))
+		die("cannot create files");
+
+	for (i = 0; i < HELD_FDS; i++) {
+		fds[i] = fs_open("held");
+		if (fds[i] < 0)
+			die("cannot open 'held' %d times", i + 1);
+	}
+
+	start = now();
+	for (i = 0; i < OPENS; i++) {
+		fd = fs_open("opened");
+		if (fd < 0 || fs_close(fd))
+			die("cannot open 'opened'");
+	}
+	report("open_close_held", HELD_FDS, OPENS / (now() - start), "ops/s");
+
+	for (i = 0; i < HELD_FDS; i++)
+		fs_close(fds[i]);
+	fs_delete("held");
+	fs_delete("opened");
+	umount_disk();
+	opts = saved;
+}
+
+static void print_results(const char *format)
+{
+	int i;
+
+	if (!strcmp(format, "json")) {
+		printf("[\n");
+		for (i = 0; i < nresults; i++)
+			printf("  {\"benchmark\": \"%s\", \"param\": %zu, "
+			       "\"value\": %.3f, \"unit\": \"%s\"}%s\n",
+			       results[i].name, results[i].param,
+			       results[i].value, results[i].unit,
+			       i < nresults - 1 ? "," : "");
+		printf("]\n");
+		return;
+	}
+
+	printf("benchmark,param,value,unit\n");
+	for (i = 0; i < nresults; i++)
+		printf("%s,%zu,%.3f,%s\n", results[i].name, results[i].param,
+		       results[i].value, results[i].unit);
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-f csv|json] [-d <diskname>] "
+		"[-b <data blocks>] [-v <version>] [-e] [-c <cache blocks>] [-m] "
+		"[-j] [-k]\n",
+		program);
+	fprintf(stderr, "\t-f\toutput format (default csv)\n");
+	fprintf(stderr, "\t-d\tscratch disk, overwritten (default %s)\n",
+		diskname);
+	fprintf(stderr, "\t-b\tdata blocks of the scratch disk (default %d)\n",
+		FS_DATA_BLOCKS_MAX);
+	fprintf(stderr, "\t-v\tformat version, as in fs_format()\n");
+	fprintf(stderr, "\t-e\tformat with extents\n");
+	fprintf(stderr, "\t-c\tblock cache size, as in fs_mount_opts()\n");
+	fprintf(stderr, "\t-m\tmount with mmap\n");
+	fprintf(stderr, "\t-j\tmount with a journal\n");
+	fprintf(stderr, "\t-k\tkeep the scratch disk\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_options fopts = { 0 };
+	const char *format = "csv";
+	size_t size;
+	int keep = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:d:b:v:ec:mjk")) != -1) {
+		switch (opt) {
+		case 'f':
+			format = optarg;
+			if (strcmp(format, "csv") && strcmp(format, "json"))
+				usage(argv[0]);
+			break;
+		case 'd':
+			diskname = optarg;
+			break;
+		case 'b':
+			data_blocks = strtoul(optarg, NULL, 0);
+			if (data_blocks < MIN_DATA_BLOCKS
+			    || data_blocks > FS2_DATA_BLOCKS_MAX)
+				die("data blocks must be in [%d, %d]",
+				    MIN_DATA_BLOCKS, FS2_DATA_BLOCKS_MAX);
+			break;
+		case 'v':
+			fopts.version = atoi(optarg);
+			break;
+		case 'e':
+			fopts.extents = 1;
+			break;
+		case 'c':
+			opts.cache_blocks = atoi(optarg);
+			break;
+		case 'm':
+			opts.mmap = 1;
+			break;
+		case 'j':
+			opts.journal = 1;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/*
+	 * Leave room for the journal and the appends, and make the transfers a
+	 * whole number of chunks
+	 */
+	size = (data_blocks - APPENDS * APPEND_SIZE / BLOCK_SIZE) / 2 * BLOCK_SIZE;
+	if (size > MAX_FILE_SIZE)
+		size = MAX_FILE_SIZE;
+	size -= size % chunk_sizes[ARRAY_SIZE(chunk_sizes) - 1];
+
+	fopts.journal = opts.journal;
+	if (fs_format(diskname, data_blocks, &fopts))
+		die("cannot format '%s'", diskname);
+
+	bench_sequential(size);
+	bench_random_read(size);
+	bench_append();
+
+	/* Only the root directory can have extents */
+	if (!fopts.extents)
+		bench_directory();
+
+	bench_open_many();
+
+	/* Leaves the root directory full */
+	bench_metadata();
+
+	if (!keep)
+		unlink(diskname);
+
+	print_results(format);
+
+	return 0;
+}
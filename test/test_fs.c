@@ -1,11 +1,13 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -39,7 +41,7 @@ void thread_fs_stat(void *arg)
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
 	int fs_fd;
-	int stat;
+	size_t stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -56,8 +58,8 @@ void thread_fs_stat(void *arg)
 		die("Cannot open file");
 	}
 
-	stat = fs_stat(fs_fd);
-	if (stat < 0) {
+	/* Files of a version 2 file system can be larger than an int */
+	if (fs_size(fs_fd, &stat)) {
 		fs_close(fs_fd);
 		fs_umount();
 		die("Cannot stat file");
@@ -78,7 +80,7 @@ void thread_fs_stat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	printf("Size of file '%s' is %zu bytes\n", filename, stat);
 }
 
 void thread_fs_cat(void *arg)
@@ -137,6 +139,157 @@ void thread_fs_cat(void *arg)
 	free(buf);
 }
 
+/*
+ * Append strings to a file, one line each, alternating between two file
+ * descriptors, and read the file through a third one before any of them is
+ * synced or closed
+ */
+void thread_fs_append(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	char line[BUFSIZ];
+	int fs_fd[3];
+	int i, len, stat, read;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <string> [<string>...]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* The file may already exist */
+	fs_create(filename);
+
+	for (i = 0; i < 3; i++) {
+		fs_fd[i] = fs_open(filename);
+		if (fs_fd[i] < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+	}
+
+	for (i = 2; i < t_arg->argc; i++) {
+		len = snprintf(line, sizeof(line), "%s\n", t_arg->argv[i]);
+		if (len >= (int)sizeof(line))
+			die("String too long");
+
+		/* Each descriptor has its own offset */
+		if (fs_lseek(fs_fd[i % 2], fs_stat(fs_fd[i % 2])) ||
+		    fs_write(fs_fd[i % 2], line, len) != len) {
+			fs_umount();
+			die("Cannot append to file");
+		}
+	}
+
+	stat = fs_stat(fs_fd[2]);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+	buf = malloc(stat);
+	if (!buf) {
+		perror("malloc");
+		fs_umount();
+		die("Cannot malloc");
+	}
+
+	read = fs_read(fs_fd[2], buf, stat);
+
+	for (i = 0; i < 3; i++) {
+		if (fs_close(fs_fd[i])) {
+			fs_umount();
+			die("Cannot close file");
+		}
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
+	printf("Content of the file:\n");
+	printf("%.*s", (int)stat, buf);
+
+	free(buf);
+}
+
+/*
+ * Open a file as many times as allowed, up to a count, with a limit on the
+ * number of open file descriptors (0 for the default). Then close one of them in
+ * the middle and open the file again.
+ */
+void thread_fs_open(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_options opts = { 0 };
+	char *diskname, *filename;
+	int i, count, opened, closed, reopened;
+	int *fs_fd;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <count> [<open_max>]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	count = atoi(t_arg->argv[2]);
+	if (t_arg->argc > 3)
+		opts.open_max = atoi(t_arg->argv[3]);
+
+	if (count < 1)
+		die("Invalid count");
+
+	fs_fd = malloc(count * sizeof(int));
+	if (!fs_fd)
+		die_perror("malloc");
+
+	if (fs_mount_opts(diskname, &opts))
+		die("Cannot mount diskname");
+
+	for (opened = 0; opened < count; opened++) {
+		fs_fd[opened] = fs_open(filename);
+		if (fs_fd[opened] < 0)
+			break;
+	}
+
+	if (!opened) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	/* The descriptor is free again for the next open */
+	closed = fs_fd[opened / 2];
+	if (fs_close(closed)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	reopened = fs_open(filename);
+	if (reopened < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	fs_fd[opened / 2] = reopened;
+
+	for (i = 0; i < opened; i++) {
+		if (fs_close(fs_fd[i])) {
+			fs_umount();
+			die("Cannot close file");
+		}
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Opened file '%s' %d times\n", filename, opened);
+	printf("Reopened file as fd %d after closing fd %d\n", reopened,
+	       closed);
+
+	free(fs_fd);
+}
+
 void thread_fs_rm(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -162,6 +315,31 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_mkdir(dirname)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -225,20 +403,172 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+/*
+ * Images of the virtual disk as of the last two calls to fdatasync(), kept by
+ * thread_fs_jcrash() while it is enabled
+ */
+static struct {
+	int enabled;
+	char *image[2];
+	off_t size;
+	unsigned int count;
+} synced;
+
+/* Replaces the C library's for the file-system library linked in */
+int fdatasync(int fd)
+{
+	char *image;
+
+	if (synced.enabled) {
+		image = synced.image[synced.count++ % 2];
+		if (pread(fd, image, synced.size, 0) != synced.size)
+			die_perror("pread");
+	}
+
+	return syscall(SYS_fdatasync, fd);
+}
+
+/*
+ * Add host files like thread_fs_add() on a disk mounted with a journal, making
+ * each one durable with fs_fsync()
+ */
+static void jadd_files(char *diskname, int count, char **filenames)
+{
+	struct fs_mount_options opts = { 0 };
+	char *filename, *buf;
+	int i, fd, fs_fd;
+	struct stat st;
+	int written;
+
+	/* Only fs_fsync() commits */
+	opts.journal = 1;
+	opts.commit_interval = -1;
+	if (fs_mount_opts(diskname, &opts))
+		die("Cannot mount diskname");
+
+	for (i = 0; i < count; i++) {
+		filename = filenames[i];
+
+		fd = open(filename, O_RDONLY);
+		if (fd < 0)
+			die_perror("open");
+		if (fstat(fd, &st))
+			die_perror("fstat");
+		if (!S_ISREG(st.st_mode))
+			die("Not a regular file: %s\n", filename);
+
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED)
+			die_perror("mmap");
+
+		if (fs_create(filename))
+			die("Cannot create file");
+
+		fs_fd = fs_open(filename);
+		if (fs_fd < 0)
+			die("Cannot open file");
+
+		written = fs_write(fs_fd, buf, st.st_size);
+
+		if (fs_fsync(fs_fd))
+			die("Cannot sync file");
+
+		if (fs_close(fs_fd))
+			die("Cannot close file");
+
+		printf("Committed file '%s' (%d/%zu bytes)\n", filename,
+		       written, st.st_size);
+
+		munmap(buf, st.st_size);
+		close(fd);
+	}
+}
+
+/*
+ * Add host files with jadd_files(), then get killed instead of unmounting the
+ * disk, as in a crash. The next mount replays the journal.
+ */
+void thread_fs_jadd(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [<host filename>...]");
+
+	jadd_files(t_arg->argv[0], t_arg->argc - 1, &t_arg->argv[1]);
+
+	/* Crash without unmounting */
+	fflush(stdout);
+	kill(getpid(), SIGKILL);
+}
+
+/*
+ * Same as thread_fs_jadd(), but also copy the disk as it was made durable by
+ * the sync before the last one. Whatever the file system wrote in between may
+ * not have reached the disk if the crash happened during the last sync.
+ */
+void thread_fs_jcrash(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *copyname;
+	struct stat st;
+	int fd;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <copy filename> <host filename> "
+		    "[<host filename>...]");
+
+	diskname = t_arg->argv[0];
+	copyname = t_arg->argv[1];
+
+	if (stat(diskname, &st))
+		die_perror("stat");
+
+	synced.size = st.st_size;
+	synced.image[0] = malloc(st.st_size);
+	synced.image[1] = malloc(st.st_size);
+	if (!synced.image[0] || !synced.image[1])
+		die_perror("malloc");
+	synced.enabled = 1;
+
+	jadd_files(diskname, t_arg->argc - 2, &t_arg->argv[2]);
+
+	if (synced.count < 2)
+		die("Fewer than two syncs");
+
+	fd = open(copyname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
+	if (write(fd, synced.image[synced.count % 2], synced.size)
+	    != synced.size)
+		die_perror("write");
+	close(fd);
+
+	/* Crash without unmounting */
+	fflush(stdout);
+	kill(getpid(), SIGKILL);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname> <filename>");
+		die("Usage: <diskname> [<dirname>]");
 
 	diskname = t_arg->argv[0];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	/* List the root directory unless given another one */
+	if (t_arg->argc > 1 && fs_ls_dir(t_arg->argv[1])) {
+		fs_umount();
+		die("Cannot list directory");
+	} else if (t_arg->argc == 1) {
+		fs_ls();
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
@@ -263,6 +593,88 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+static const char *op_names[FS_OP_COUNT] = {
+	[FS_OP_CREATE]		= "create",
+	[FS_OP_DELETE]		= "delete",
+	[FS_OP_LS]		= "ls",
+	[FS_OP_OPEN]		= "open",
+	[FS_OP_CLOSE]		= "close",
+	[FS_OP_STAT]		= "stat",
+	[FS_OP_LSEEK]		= "lseek",
+	[FS_OP_READ]		= "read",
+	[FS_OP_WRITE]		= "write",
+	[FS_OP_PREAD]		= "pread",
+	[FS_OP_PWRITE]		= "pwrite",
+	[FS_OP_FALLOCATE]	= "fallocate",
+	[FS_OP_AIO_SUBMIT]	= "aio_submit",
+	[FS_OP_SYNC]		= "sync",
+	[FS_OP_FSYNC]		= "fsync",
+	[FS_OP_MKDIR]		= "mkdir",
+};
+
+static void print_latency(const char *name, const size_t *histogram)
+{
+	int i;
+
+	/* Bucket i holds the calls of 2^i to 2^(i+1) - 1 ns */
+	for (i = 0; i < FS_LATENCY_BUCKETS; i++)
+		if (histogram[i])
+			printf("%s_latency_ns_%llu=%zu\n", name, 1ULL << i,
+			       histogram[i]);
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_stats stats;
+	char *diskname, buf[4096];
+	int i, fs_fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename>...]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Read the given files through to gather some activity */
+	for (i = 1; i < t_arg->argc; i++) {
+		fs_fd = fs_open(t_arg->argv[i]);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+		while (fs_read(fs_fd, buf, sizeof(buf)) > 0)
+			;
+		fs_close(fs_fd);
+	}
+
+	if (fs_stats(&stats)) {
+		fs_umount();
+		die("Cannot get stats");
+	}
+
+	printf("FS Stats:\n");
+	for (i = 0; i < FS_OP_COUNT; i++)
+		printf("calls_%s=%zu\n", op_names[i], stats.calls[i]);
+	printf("bytes_read=%zu\n", stats.bytes_read);
+	printf("bytes_written=%zu\n", stats.bytes_written);
+	printf("disk_reads=%zu\n", stats.disk_reads);
+	printf("disk_writes=%zu\n", stats.disk_writes);
+	printf("blocks_read=%zu\n", stats.blocks_read);
+	printf("blocks_written=%zu\n", stats.blocks_written);
+	printf("chain_steps=%zu\n", stats.chain_steps);
+	printf("allocations=%zu\n", stats.allocations);
+	printf("alloc_scanned=%zu\n", stats.alloc_scanned);
+	print_latency("read", stats.read_latency);
+	print_latency("write", stats.write_latency);
+	print_latency("open", stats.open_latency);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -271,6 +683,28 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_format_options opts = { 0 };
+	char *diskname;
+	size_t nblocks;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [<version>] "
+		    "[extents]");
+
+	diskname = t_arg->argv[0];
+	nblocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		opts.version = get_argv(t_arg->argv[2]);
+	if (t_arg->argc > 3)
+		opts.extents = !strcmp(t_arg->argv[3], "extents");
+
+	if (fs_format(diskname, nblocks, &opts))
+		die("Cannot format diskname");
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -278,9 +712,16 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "jadd",	thread_fs_jadd },
+	{ "jcrash",	thread_fs_jcrash },
 	{ "rm",		thread_fs_rm },
+	{ "append",	thread_fs_append },
+	{ "open",	thread_fs_open },
+	{ "mkdir",	thread_fs_mkdir },
 	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat }
+	{ "stat",	thread_fs_stat },
+	{ "stats",	thread_fs_stats },
+	{ "format",	thread_fs_format }
 };
 
 void usage(char *program)
@@ -251,6 +251,422 @@ run_fs_create_multiple() {
 	add_answer "${sub}"
 }
 
+# Appends buffered on two fds of a file are read back through a third one
+# before any sync, and are on disk after unmounting
+run_fs_append() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_test ./test_fs.x append test.fs test-file-1 first second third
+	local read="${STDOUT}"
+	run_test ./test_fs.x cat test.fs test-file-1
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${read}" "1")")
+	line_array+=("$(select_line "${read}" "3")")
+	line_array+=("$(select_line "${read}" "4")")
+	line_array+=("$(select_line "${read}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	local corr_array=()
+	corr_array+=("Read file 'test-file-1' (19/19 bytes)")
+	corr_array+=("first")
+	corr_array+=("second")
+	corr_array+=("third")
+	corr_array+=("Read file 'test-file-1' (19/19 bytes)")
+	corr_array+=("third")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.16"
+	inc_total
+	add_answer "${sub}"
+}
+
+#
+# Phase 3
+#
+
+# Read an unsigned integer of a disk image
+read_uint() {
+	# 1: disk image
+	# 2: byte offset
+	# 3: size in bytes
+	od -An -tu${3} -j${2} -N${3} "${1}" | tr -d ' '
+}
+
+# Byte offset of a slot of the journal of a version 1 disk
+journal_slot() {
+	# 1: disk image
+	# 2: slot
+	local data_start=$(read_uint "${1}" 12 2)
+	local journal_start=$(read_uint "${1}" 25 2)
+	local journal_blocks=$(read_uint "${1}" 27 2)
+	echo $(( (data_start + journal_start + ${2} * (journal_blocks / 2)) * 4096 ))
+}
+
+# Crash after a commit, remount and find the file through the journal
+run_fs_journal_replay() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 1000
+	printf "journaled data\n" > test-file-1
+	run_tool ./test_fs.x jadd test.fs test-file-1
+
+	# Nothing was written in place before the crash
+	run_test ./fs_ref.x ls test.fs
+	local before="${STDOUT}"
+
+	run_test ./test_fs.x ls test.fs
+	local after="${STDOUT}"
+	run_test ./test_fs.x cat test.fs test-file-1
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("${before}")
+	line_array+=("$(select_line "${after}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	local corr_array=()
+	corr_array+=("FS Ls:")
+	corr_array+=("file: test-file-1, size: 15, data_blk: 37")
+	corr_array+=("Read file 'test-file-1' (15/15 bytes)")
+	corr_array+=("journaled data")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.25"
+	inc_total
+	add_answer "${sub}"
+}
+
+# Crash after two commits, tear the last one and lose the root directory
+# written in place: the first commit is replayed
+run_fs_journal_torn() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 1000
+	printf "first commit\n" > test-file-1
+	printf "second commit\n" > test-file-2
+	run_tool ./test_fs.x jadd test.fs test-file-1 test-file-2
+
+	# Commits alternate between the two slots, the second is in slot 0
+	local slot=$(journal_slot test.fs 0)
+	local sequence=$(read_uint test.fs $((slot + 8)) 8)
+	run_tool dd if=/dev/zero of=test.fs bs=1 seek=$((slot + 4096)) count=64 \
+		conv=notrunc
+	run_tool dd if=/dev/zero of=test.fs bs=4096 seek=2 count=1 conv=notrunc
+
+	run_test ./test_fs.x ls test.fs
+	local after="${STDOUT}"
+	run_test ./test_fs.x cat test.fs test-file-1
+	rm -f test.fs test-file-1 test-file-2
+
+	local line_array=()
+	line_array+=("${sequence}")
+	line_array+=("$(select_line "${after}" "2")")
+	line_array+=("$(select_line "${after}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	local corr_array=()
+	corr_array+=("2")
+	corr_array+=("file: test-file-1, size: 13, data_blk: 37")
+	corr_array+=("")
+	corr_array+=("first commit")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.25"
+	inc_total
+	add_answer "${sub}"
+}
+
+# Crash during the sync of a second commit, when only its slot was written since
+# the previous sync: the blocks written in place for the first commit survive
+run_fs_journal_order() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 1000
+	mkdir -p dir
+	printf "first commit\n" > dir/test-file-1
+	printf "second commit\n" > test-file-2
+	run_tool ./test_fs.x mkdir test.fs dir
+	run_tool ./test_fs.x jcrash test.fs crash.fs dir/test-file-1 test-file-2
+
+	# The second commit is in slot 0
+	local slot=$(( $(journal_slot test.fs 0) / 4096 ))
+	local blocks=$(( $(read_uint test.fs 27 2) / 2 ))
+	run_tool dd if=test.fs of=crash.fs bs=4096 skip=${slot} seek=${slot} \
+		count=${blocks} conv=notrunc
+
+	run_test ./test_fs.x ls crash.fs dir
+	local listed="${STDOUT}"
+	run_test ./test_fs.x cat crash.fs dir/test-file-1
+	local first="${STDOUT}"
+	run_test ./test_fs.x cat crash.fs test-file-2
+	rm -rf test.fs crash.fs dir test-file-2
+
+	local line_array=()
+	line_array+=("$(select_line "${listed}" "2")")
+	line_array+=("$(select_line "${first}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	local corr_array=()
+	corr_array+=("file: test-file-1, size: 13, data_blk: 38")
+	corr_array+=("first commit")
+	corr_array+=("second commit")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.33"
+	inc_total
+	add_answer "${sub}"
+}
+
+#
+# Phase 4
+#
+
+# Create, read and delete a file two directories down. Paths start from the
+# root directory, with or without a leading '/'
+run_fs_dir_nested() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	mkdir -p dir/sub
+	printf "nested file\n" > dir/sub/file
+	run_tool ./test_fs.x mkdir test.fs dir
+	run_tool ./test_fs.x mkdir test.fs /dir/sub
+	run_tool ./test_fs.x add test.fs dir/sub/file
+
+	run_test ./test_fs.x ls test.fs /dir/sub
+	local listed="${STDOUT}"
+	run_test ./test_fs.x cat test.fs /dir/sub/file
+	local read="${STDOUT}"
+	run_tool ./test_fs.x rm test.fs dir/sub/file
+	run_test ./test_fs.x ls test.fs dir/sub
+	local deleted="${STDOUT}"
+	run_test ./test_fs.x ls test.fs
+	rm -rf test.fs dir
+
+	local line_array=()
+	line_array+=("$(select_line "${listed}" "2")")
+	line_array+=("$(select_line "${read}" "3")")
+	line_array+=("${deleted}")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	local corr_array=()
+	corr_array+=("file: file, size: 12, data_blk: 3")
+	corr_array+=("nested file")
+	corr_array+=("FS Ls:")
+	corr_array+=("dir: dir, size: 4096, data_blk: 1")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.25"
+	inc_total
+	add_answer "${sub}"
+}
+
+# A directory can only be deleted once empty
+run_fs_dir_delete() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	mkdir -p dir
+	printf "data\n" > dir/file
+	run_tool ./test_fs.x mkdir test.fs dir
+	run_tool ./test_fs.x add test.fs dir/file
+
+	run_test ./test_fs.x rm test.fs dir
+	local full="${STDERR}"
+	run_tool ./test_fs.x rm test.fs dir/file
+	run_test ./test_fs.x rm test.fs dir
+	local empty="${STDOUT}"
+	run_test ./test_fs.x ls test.fs
+	rm -rf test.fs dir
+
+	local line_array=()
+	line_array+=("${full}")
+	line_array+=("${empty}")
+	line_array+=("${STDOUT}")
+	local corr_array=()
+	corr_array+=("thread_fs_rm: Cannot delete file")
+	corr_array+=("Removed file 'dir'")
+	corr_array+=("FS Ls:")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.33"
+	inc_total
+	add_answer "${sub}"
+}
+
+# A directory grows past the 127 entries of its first block, and is found
+# whole by each mount
+run_fs_dir_grow() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 200
+	mkdir -p dir
+	run_tool ./test_fs.x mkdir test.fs dir
+
+	local i
+	for i in $(seq 1 130); do
+		printf "file ${i}\n" > dir/file${i}
+		./test_fs.x add test.fs dir/file${i} > /dev/null 2>&1
+	done
+
+	run_test ./test_fs.x ls test.fs
+	local root="${STDOUT}"
+	run_test ./test_fs.x ls test.fs dir
+	local listed="${STDOUT}"
+	run_test ./test_fs.x cat test.fs dir/file130
+	rm -rf test.fs dir
+
+	local line_array=()
+	line_array+=("$(select_line "${root}" "2")")
+	line_array+=("$(echo "${listed}" | grep -c "^file: ")")
+	line_array+=("$(select_line "${listed}" "131")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	local corr_array=()
+	corr_array+=("dir: dir, size: 8192, data_blk: 1")
+	corr_array+=("130")
+	corr_array+=("file: file130, size: 9, data_blk: 132")
+	corr_array+=("file 130")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.25"
+	inc_total
+	add_answer "${sub}"
+}
+
+# Files stored as extents only have the root directory
+run_fs_dir_extents() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./test_fs.x format test.fs 100 2 extents
+	run_test ./test_fs.x mkdir test.fs dir
+	local made="${STDERR}"
+	run_test ./test_fs.x ls test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("${made}")
+	line_array+=("${STDOUT}")
+	local corr_array=()
+	corr_array+=("thread_fs_mkdir: Cannot create directory")
+	corr_array+=("FS Ls:")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.5"
+	inc_total
+	add_answer "${sub}"
+}
+
+#
+# Phase 5
+#
+
+# A version 2 disk with more data blocks than a 16-bit FAT can address holds a
+# file larger than 64 KiB, read back whole by the next mount
+run_fs_v2_large() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./test_fs.x format test.fs 70000 2
+	seq 1 20000 > test-file-1
+	run_tool ./test_fs.x add test.fs test-file-1
+
+	run_test ./test_fs.x info test.fs
+	local info="${STDOUT}"
+	run_test ./test_fs.x stat test.fs test-file-1
+	local size="${STDOUT}"
+	run_test ./test_fs.x cat test.fs test-file-1
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${info}" "3")")
+	line_array+=("$(select_line "${info}" "7")")
+	line_array+=("${size}")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "20002")")
+	local corr_array=()
+	corr_array+=("fat_blk_count=69")
+	corr_array+=("fat_free_ratio=69972/70000")
+	corr_array+=("Size of file 'test-file-1' is 108894 bytes")
+	corr_array+=("Read file 'test-file-1' (108894/108894 bytes)")
+	corr_array+=("20000")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+# A file stored as extents is written, read back, grown by a block and deleted
+run_fs_extents() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./test_fs.x format test.fs 100 2 extents
+	seq 1 20000 > test-file-1
+	run_tool ./test_fs.x add test.fs test-file-1
+
+	run_test ./test_fs.x cat test.fs test-file-1
+	local read="${STDOUT}"
+	./test_fs.x append test.fs test-file-1 "$(printf "%02000d" 0)" \
+		> /dev/null 2>&1
+	run_test ./test_fs.x info test.fs
+	local grown="${STDOUT}"
+	run_test ./test_fs.x cat test.fs test-file-1
+	local reread="${STDOUT}"
+	run_tool ./test_fs.x rm test.fs test-file-1
+	run_test ./test_fs.x info test.fs
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${read}" "20002")")
+	line_array+=("$(select_line "${grown}" "7")")
+	line_array+=("$(select_line "${reread}" "1")")
+	line_array+=("$(select_line "${reread}" "20002")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("20000")
+	corr_array+=("fat_free_ratio=71/100")
+	corr_array+=("Read file 'test-file-1' (110895/110895 bytes)")
+	corr_array+=("20000")
+	corr_array+=("fat_free_ratio=99/100")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+# More files than the first chunk of the file table holds are opened, up to the
+# limit given at mount, and a closed descriptor is reused
+run_fs_open_many() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	printf "opened\n" > test-file-1
+	run_tool ./test_fs.x add test.fs test-file-1
+
+	run_test ./test_fs.x open test.fs test-file-1 100 40
+	local limited="${STDOUT}"
+	run_test ./test_fs.x open test.fs test-file-1 100
+	local default="${STDOUT}"
+	run_test ./test_fs.x open test.fs test-file-1 100 -1
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${limited}" "1")")
+	line_array+=("$(select_line "${limited}" "2")")
+	line_array+=("$(select_line "${default}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("Opened file 'test-file-1' 40 times")
+	corr_array+=("Reopened file as fd 20 after closing fd 20")
+	corr_array+=("Opened file 'test-file-1' 32 times")
+	corr_array+=("Opened file 'test-file-1' 100 times")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.25"
+	inc_total
+	add_answer "${sub}"
+}
+
 #
 # Run tests
 #
@@ -261,6 +677,20 @@ run_tests() {
 	# Phase 2
 	run_fs_simple_create
 	run_fs_create_multiple
+	run_fs_append
+	# Phase 3
+	run_fs_journal_replay
+	run_fs_journal_torn
+	run_fs_journal_order
+	# Phase 4
+	run_fs_dir_nested
+	run_fs_dir_delete
+	run_fs_dir_grow
+	run_fs_dir_extents
+	# Phase 5
+	run_fs_v2_large
+	run_fs_extents
+	run_fs_open_many
 }
 
 make_fs() {